@@ -0,0 +1,88 @@
+/* crc32c.c - CRC32C (Castagnoli) checksums for the vvsfs user space tools.
+   Uses the SSE4.2 crc32 instruction when the cpu has it, otherwise a table.
+   GPL */
+
+/* To compile :
+     link it with the tool using it, e.g.
+     gcc mkfs.vvsfs.c crc32c.c -o mkfs.vvsfs
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "vvsfs.h"
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82F63B78  // the reversed Castagnoli polynomial
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+  uint32_t c;
+  int i, k;
+
+  if (!crc32c_table[1]) {  // build the table on first use
+    for (i = 0; i < 256; i++) {
+      c = i;
+      for (k = 0; k < 8; k++)
+        c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+      crc32c_table[i] = c;
+    }
+  }
+  while (len--)
+    crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+  uint64_t c = crc;
+  uint64_t v;
+
+  while (len && ((uintptr_t) p & 7)) {  // align to 8 bytes
+    c = _mm_crc32_u8(c, *p++);
+    len--;
+  }
+  while (len >= 8) {
+    memcpy(&v, p, 8);
+    c = _mm_crc32_u64(c, v);
+    p += 8;
+    len -= 8;
+  }
+  while (len--)
+    c = _mm_crc32_u8(c, *p++);
+  return c;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2"))
+    return crc32c_sse42(crc, buf, len);
+#endif
+  return crc32c_sw(crc, buf, len);
+}
+
+uint32_t vvsfs_block_csum(const struct vvsfs_inode *inode) {
+  const uint32_t zero = 0;
+  const size_t off = offsetof(struct vvsfs_inode, csum);
+  uint32_t crc;
+
+  crc = crc32c(~0, inode, off);
+  crc = crc32c(crc, &zero, sizeof(zero));
+  return crc32c(crc, (const char *) inode + off + sizeof(zero),
+                BLOCKSIZE - off - sizeof(zero));
+}
+
+int vvsfs_block_discarded(const struct vvsfs_inode *inode) {
+  const unsigned char *p = (const unsigned char *) inode;
+  int k;
+
+  for (k = 0; k < BLOCKSIZE; k++)
+    if (p[k]) return 0;
+  return 1;
+}
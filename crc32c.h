@@ -0,0 +1,19 @@
+/* crc32c.h - CRC32C (Castagnoli) checksums for the vvsfs user space tools
+   GPL */
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct vvsfs_inode;
+
+// crc32c - continue the CRC32C crc over len bytes of buf (no pre or post
+//          inversion, the same as crc32c() in the kernel)
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+// vvsfs_block_csum - the checksum vvsfs keeps in the csum field of a block
+uint32_t vvsfs_block_csum(const struct vvsfs_inode *inode);
+
+// vvsfs_block_discarded - whether a block is all zeros, which is how a block
+//                         discarded by FITRIM or -o discard reads back. vvsfs
+//                         takes such a block as an empty one.
+int vvsfs_block_discarded(const struct vvsfs_inode *inode);
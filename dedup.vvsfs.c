@@ -0,0 +1,117 @@
+
+/*
+ * dedup.vvsfs - find regular files with identical contents in a vvsfs file
+ *               system
+ *
+ * GPL
+ * To compile :
+ *   gcc dedup.vvsfs.c crc32c.c -o dedup.vvsfs
+ *
+ * Every vvsfs file lives in its own block, so the only way two files could
+ * share their data is to be hard links of the same inode, and that changes
+ * what a write to one of them does. vvsfs has no copy on write sharing, so
+ * the duplicates are only reported (with the inode holding the first copy),
+ * the image is opened read only and never changed.
+ * The file system should not be mounted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "vvsfs.h"
+#include "crc32c.h"
+
+#define HASHSIZE (2*NUMBLOCKS)  // open addressing, never more than half full
+
+char* device_name;
+int device;
+
+static void die(char *mess) {
+  fprintf(stderr,"Exit : %s\n",mess);
+  exit(1);
+}
+
+static void usage(void) {
+   die("Usage : dedup.vvsfs <device name>)");
+}
+
+// content_len - the number of bytes of data in use
+static int content_len(struct vvsfs_inode *inode) {
+  return (inode->flags & VVSFS_FL_COMPRESSED) ? inode->csize : inode->size;
+}
+
+// content_hash - FNV-1a over the stored contents of a file
+static uint64_t content_hash(struct vvsfs_inode *inode) {
+  uint64_t h = 14695981039346656037ULL;
+  int k, len = content_len(inode);
+
+  h = (h ^ (uint32_t) inode->size) * 1099511628211ULL;
+  for (k = 0; k < len; k++)
+    h = (h ^ (unsigned char) inode->data[k]) * 1099511628211ULL;
+  return h;
+}
+
+static int same_content(struct vvsfs_inode *a, struct vvsfs_inode *b) {
+  return a->size == b->size &&
+         (a->flags & VVSFS_FL_COMPRESSED) == (b->flags & VVSFS_FL_COMPRESSED) &&
+         content_len(a) == content_len(b) &&
+         memcmp(a->data, b->data, content_len(a)) == 0;
+}
+
+int main(int argc, char ** argv) {
+  struct vvsfs_inode blocks[NUMBLOCKS];
+  uint64_t hashes[HASHSIZE];
+  int index[HASHSIZE];  // hash -> inode number, -1 when the slot is free
+  int dups = 0, saved = 0;
+  int i, slot, first;
+  uint64_t h;
+
+  if (argc != 2) usage();
+
+  device_name = argv[1];
+  device = open(device_name, O_RDONLY);
+  if (device < 0) die("unable to open device");
+
+  if (pread(device, blocks, sizeof(blocks), 0) != sizeof(blocks))
+    die("image read failed");
+
+  for (i = 0; i < HASHSIZE; i++) index[i] = -1;
+
+  // build the hash -> inode index, and find the duplicates
+  for (i = 0; i < NUMBLOCKS; i++) {
+    if (vvsfs_block_discarded(&blocks[i])) continue;  // empty after a discard
+    if (blocks[i].csum != vvsfs_block_csum(&blocks[i]))
+      die("checksum errors, run fsck.vvsfs");
+    if (blocks[i].is_empty || blocks[i].is_directory) continue;
+    if (blocks[i].flags & VVSFS_FL_ORPHAN) continue;  // freed at the next mount
+    if (blocks[i].flags & VVSFS_FL_SYMLINK) continue;  // data is a link target, not contents
+    // the extended attributes may differ, and an overflow block is no file
+    if (blocks[i].flags & (VVSFS_FL_XATTR | VVSFS_FL_XATTR_BLOCK)) continue;
+
+    h = content_hash(&blocks[i]);
+    first = -1;
+    for (slot = h % HASHSIZE; index[slot] != -1; slot = (slot + 1) % HASHSIZE) {
+      if (hashes[slot] == h && same_content(&blocks[index[slot]], &blocks[i])) {
+        first = index[slot];
+        break;
+      }
+    }
+    if (first >= 0) {
+      printf("%2d : same as %d (%llu bytes)\n", i, first, (unsigned long long) blocks[i].size);
+      dups++;
+      saved += content_len(&blocks[i]);
+    } else {
+      index[slot] = i;
+      hashes[slot] = h;
+    }
+  }
+  printf("%d duplicate files, %d bytes of data\n", dups, saved);
+
+  close(device);
+  return 0;
+}
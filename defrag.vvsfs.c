@@ -0,0 +1,98 @@
+
+/*
+ * defrag.vvsfs - compact the directories of a mounted vvsfs file system and
+ *                move the inodes of each directory into the blocks after it
+ *
+ * GPL
+ * To compile :
+ *   gcc defrag.vvsfs.c -o defrag.vvsfs
+ *
+ * The work is done by the VVSFS_IOC_DEFRAG ioctl (vvsfs_defrag_dir), one
+ * directory at a time. The tree is walked breadth first from the mount point,
+ * so a directory is in its place before its entries are moved up behind it.
+ * A file's data always lives in its own inode block, so there is nothing to
+ * gather for files themselves. Inodes that are open, cached or have more than
+ * one name keep their place, run it on a quiet file system for the best result.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "vvsfs.h"
+
+// the directories still to do, every directory fits as there is one per block
+char *queue[NUMBLOCKS];
+int queue_head, queue_tail;
+
+static void die(char *mess) {
+  fprintf(stderr,"Exit : %s\n",mess);
+  exit(1);
+}
+
+static void usage(void) {
+   die("Usage : defrag.vvsfs <mount point>)");
+}
+
+// defrag_dir - defragment the directory at path and queue its subdirectories
+static int defrag_dir(const char *path, dev_t dev) {
+  struct dirent *de;
+  struct stat st;
+  char *child;
+  DIR *dir;
+  int moved;
+
+  dir = opendir(path);
+  if (!dir) {
+    perror(path);
+    return 0;
+  }
+  moved = ioctl(dirfd(dir), VVSFS_IOC_DEFRAG);
+  if (moved < 0) {
+    perror(path);
+    closedir(dir);
+    return 0;
+  }
+  printf("%s : %d inodes moved\n", path, moved);
+
+  // read the entries after the ioctl, it sorts them and renumbers inodes
+  while ((de = readdir(dir)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+    child = malloc(strlen(path) + strlen(de->d_name) + 2);
+    if (!child) die("out of memory");
+    sprintf(child, "%s/%s", path, de->d_name);
+    if (lstat(child, &st) == 0 && S_ISDIR(st.st_mode) && st.st_dev == dev &&
+        queue_tail < NUMBLOCKS) {
+      queue[queue_tail++] = child;
+    } else {
+      free(child);
+    }
+  }
+  closedir(dir);
+  return moved;
+}
+
+int main(int argc, char ** argv) {
+  struct stat st;
+  int moved = 0;
+
+  if (argc != 2) usage();
+
+  if (stat(argv[1], &st) < 0 || !S_ISDIR(st.st_mode))
+    die("not a directory");
+
+  queue[queue_tail] = strdup(argv[1]);
+  if (!queue[queue_tail++]) die("out of memory");
+  for (queue_head = 0; queue_head < queue_tail; queue_head++) {
+    moved += defrag_dir(queue[queue_head], st.st_dev);
+    free(queue[queue_head]);
+  }
+  printf("%d directories, %d inodes moved\n", queue_tail, moved);
+  return 0;
+}
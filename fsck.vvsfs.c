@@ -0,0 +1,162 @@
+
+/*
+ * fsck.vvsfs - scrub a vvsfs file system: verify the checksum of every
+ *              block and check that the directories are consistent
+ *
+ * GPL
+ * To compile :
+ *   gcc -O2 fsck.vvsfs.c crc32c.c -o fsck.vvsfs
+ *
+ * The image is read with one large sequential read and the checksums are
+ * calculated with the SSE4.2 crc32 instruction (see crc32c.c), so a scrub
+ * runs at about the bandwidth of the disk.
+ *
+ * Exit status : 0 no errors, 4 errors found, 8 operational error
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "vvsfs.h"
+#include "crc32c.h"
+
+char* device_name;
+int device;
+int errors;
+
+static void die(char *mess) {
+  fprintf(stderr,"Exit : %s\n",mess);
+  exit(8);
+}
+
+static void usage(void) {
+   die("Usage : fsck.vvsfs <device name>)");
+}
+
+static void report(int block, char *mess) {
+  printf("%2d : %s\n", block, mess);
+  errors++;
+}
+
+int main(int argc, char ** argv) {
+  struct vvsfs_inode *blocks, *inode;
+  struct vvsfs_dir_entry *dent;
+  struct vvsfs_xattr_tail *tail;
+  char *csum_ok, *referenced;
+  size_t len, done;
+  ssize_t n;
+  int i, k, nodirs;
+
+  if (argc != 2) usage();
+
+  // open the device for reading
+  device_name = argv[1];
+  device = open(device_name,O_RDONLY);
+  if (device < 0) die("unable to open device");
+
+  len = NUMBLOCKS * sizeof(struct vvsfs_inode);
+  blocks = malloc(len);
+  csum_ok = calloc(NUMBLOCKS, 1);
+  referenced = calloc(NUMBLOCKS, 1);
+  if (!blocks || !csum_ok || !referenced) die("out of memory");
+
+  // read the whole file system in one go
+  for (done = 0; done < len; done += n) {
+    n = pread(device, (char *) blocks + done, len - done, done);
+    if (n <= 0) die("image read failed");
+  }
+
+  // pass 1 : checksums and the contents of each block
+  for (i = 0; i < NUMBLOCKS; i++) {
+    inode = &blocks[i];
+    if (vvsfs_block_discarded(inode)) {  // an empty block after a discard
+      inode->is_empty = 1;
+      csum_ok[i] = 1;
+      continue;
+    }
+    if (inode->csum != vvsfs_block_csum(inode)) {
+      report(i, "checksum error");
+      continue;
+    }
+    csum_ok[i] = 1;
+    if (inode->version != VVSFS_FORMAT_VERSION)
+      report(i, "unknown format version, recreate the file system with mkfs.vvsfs");
+    if (inode->is_empty) continue;
+
+    if (inode->flags & VVSFS_FL_XATTR) {
+      tail = (struct vvsfs_xattr_tail *) (inode->data + MAXFILESIZE - sizeof(*tail));
+      if (tail->len % 4 || tail->len > MAXFILESIZE - sizeof(*tail) ||
+          ((inode->flags & VVSFS_FL_COMPRESSED) ? inode->csize : inode->size) +
+            tail->len + sizeof(*tail) > MAXFILESIZE)
+        report(i, "bad extended attribute area");
+    }
+    if (inode->flags & VVSFS_FL_XATTR_BLOCK) continue;  // checked with its inode
+
+    if (inode->is_directory) {
+      if (inode->size > MAXFILESIZE || inode->size % sizeof(struct vvsfs_dir_entry))
+        report(i, "bad directory size");
+    } else if (inode->flags & VVSFS_FL_COMPRESSED) {
+      if (inode->size > MAXCOMPRESSEDSIZE || inode->csize > MAXFILESIZE)
+        report(i, "bad compressed size");
+    } else if (inode->size > MAXFILESIZE) {
+      report(i, "bad file size");
+    }
+  }
+  if (!csum_ok[0] || blocks[0].is_empty || !blocks[0].is_directory)
+    report(0, "root directory is missing");
+
+  // pass 2 : directory entries
+  for (i = 0; i < NUMBLOCKS; i++) {
+    inode = &blocks[i];
+    if (!csum_ok[i] || inode->is_empty || !inode->is_directory) continue;
+
+    nodirs = MIN(inode->size, MAXFILESIZE) / sizeof(struct vvsfs_dir_entry);
+    dent = (struct vvsfs_dir_entry *) inode->data;
+    for (k = 0; k < nodirs; k++, dent++) {
+      if (memchr(dent->name, '\0', MAXNAME + 1) == NULL)
+        report(i, "unterminated name in directory");
+      if (dent->inode_number == 0 || dent->inode_number >= NUMBLOCKS) {
+        report(i, "directory entry out of range");
+        continue;
+      }
+      if (csum_ok[dent->inode_number] && blocks[dent->inode_number].is_empty)
+        report(i, "directory entry points to an empty inode");
+      referenced[dent->inode_number] = 1;
+    }
+  }
+
+  // pass 2b : overflow extended attribute blocks
+  for (i = 0; i < NUMBLOCKS; i++) {
+    inode = &blocks[i];
+    if (!csum_ok[i] || inode->is_empty || !(inode->flags & VVSFS_FL_XATTR) ||
+        (inode->flags & VVSFS_FL_XATTR_BLOCK)) continue;
+    tail = (struct vvsfs_xattr_tail *) (inode->data + MAXFILESIZE - sizeof(*tail));
+    if (tail->block == 0) continue;
+    if (tail->block >= NUMBLOCKS || (csum_ok[tail->block] &&
+        !(blocks[tail->block].flags & VVSFS_FL_XATTR_BLOCK)))
+      report(i, "bad extended attribute block");
+    else
+      referenced[tail->block] = 1;
+  }
+
+  // pass 3 : inodes that no directory points to
+  for (i = 1; i < NUMBLOCKS; i++) {
+    if (!csum_ok[i] || blocks[i].is_empty || referenced[i]) continue;
+    if (blocks[i].flags & VVSFS_FL_ORPHAN)
+      printf("%2d : orphan inode, freed at the next mount\n", i);
+    else
+      report(i, "inode is not in any directory");
+  }
+
+  printf("%s : %d blocks, %d errors\n", device_name, NUMBLOCKS, errors);
+
+  free(referenced);
+  free(csum_ok);
+  free(blocks);
+  close(device);
+  return errors ? 4 : 0;
+}
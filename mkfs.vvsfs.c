@@ -5,74 +5,214 @@
    Eric McCreath 2006 GPL */
 
 /* To compile :
-     gcc mkfs.vvsfs.c -o mkfs.vvsfs
-
-   
+     gcc mkfs.vvsfs.c crc32c.c -o mkfs.vvsfs
 
+   mkfs.vvsfs -d <srcdir> <device name> also copies the directory tree srcdir
+   into the new file system, without mounting it. The whole image is built in
+   memory and written with one sequential write. The inodes are laid out
+   breadth first, so the entries of a directory sit in consecutive blocks.
 */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "vvsfs.h"
+#include "crc32c.h"
 
 char* device_name;
 int device;
 
+struct vvsfs_inode blocks[NUMBLOCKS];
+int next_free = 1;  // block 0 is the root directory
+
+// the directories still to copy, in the order their inodes were allocated
+struct pending_dir {
+  int inode_number;
+  char *path;
+} queue[NUMBLOCKS];
+int queue_head, queue_tail;
+
+// files with more than one name, so hard links stay hard links
+struct hard_link {
+  dev_t dev;
+  ino_t ino;
+  int inode_number;
+} links[NUMBLOCKS];
+int nlinks;
+
 static void die(char *mess) {
   fprintf(stderr,"Exit : %s\n",mess);
   exit(1);
 }
 
+static void die_path(char *mess, const char *path) {
+  fprintf(stderr,"Exit : %s : %s\n",path,mess);
+  exit(1);
+}
+
 static void usage(void) {
-   die("Usage : mkfs.vvsfs <device name>)");
+   die("Usage : mkfs.vvsfs [-d <source directory>] <device name>)");
 }
 
-int main(int argc, char ** argv) {
-  int k;
+static void set_times(struct vvsfs_inode *inode, struct stat *st) {
+  inode->atime = st->st_atime;
+  inode->mtime = st->st_mtime;
+  inode->ctime = st->st_ctime;
+}
 
-   if (argc != 2) usage();
+// add_entry - add name to the directory in block dir
+static void add_entry(int dir, const char *name, int inode_number, const char *path) {
+  struct vvsfs_inode *dirdata = &blocks[dir];
+  struct vvsfs_dir_entry *dent;
+
+  if (dirdata->size + sizeof(struct vvsfs_dir_entry) > MAXFILESIZE)
+    die_path("too many entries for one directory", path);
+  dent = (struct vvsfs_dir_entry *) (dirdata->data + dirdata->size);
+  memcpy(dent->name, name, strlen(name) + 1);  // checked against MAXNAME already
+  dent->inode_number = inode_number;
+  dirdata->size += sizeof(struct vvsfs_dir_entry);
+}
 
-  // open the device for reading and writing
-  device_name = argv[1];
-  device = open(device_name,O_RDWR);
-  
+// copy_entry - give the file or directory at path an inode (or find the one it
+//              already has through another hard link) and fill it in.
+//              Directories are queued, their contents are copied later.
+static int copy_entry(const char *path, struct stat *st) {
+  struct vvsfs_inode *inode;
+  int k, n, fd;
+  ssize_t len;
+
+  if (!S_ISDIR(st->st_mode) && st->st_nlink > 1) {
+    for (k = 0; k < nlinks; k++)
+      if (links[k].dev == st->st_dev && links[k].ino == st->st_ino)
+        return links[k].inode_number;
+  }
 
-  off_t pos=0;
-  struct vvsfs_inode inode;
+  if (next_free >= NUMBLOCKS) die_path("the file system is full", path);
+  n = next_free++;
+  inode = &blocks[n];
+  inode->is_empty = 0;
+  set_times(inode, st);
+
+  if (S_ISDIR(st->st_mode)) {
+    inode->is_directory = 1;
+    queue[queue_tail].inode_number = n;
+    queue[queue_tail].path = strdup(path);
+    if (!queue[queue_tail++].path) die("out of memory");
+  } else if (S_ISLNK(st->st_mode)) {
+    len = readlink(path, inode->data, MAXFILESIZE);
+    if (len < 0) die_path("unable to read link", path);
+    if (len >= MAXFILESIZE) die_path("link target too long", path);
+    inode->size = len;
+    inode->flags = VVSFS_FL_SYMLINK;
+  } else if (S_ISREG(st->st_mode)) {
+    // there is no compressor here, the data has to fit in the block as it is
+    if (st->st_size > MAXFILESIZE)
+      die_path("too big for a block, copy it into a compress=lz4 mount instead", path);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) die_path("unable to open", path);
+    len = read(fd, inode->data, st->st_size);
+    if (len != st->st_size) die_path("read failed", path);
+    close(fd);
+    inode->size = len;
+  } else {
+    die_path("not a file, directory or symbolic link", path);
+  }
 
+  if (!S_ISDIR(st->st_mode) && st->st_nlink > 1) {
+    links[nlinks].dev = st->st_dev;
+    links[nlinks].ino = st->st_ino;
+    links[nlinks++].inode_number = n;
+  }
+  return n;
+}
 
+// copy_dir - copy the entries of the directory at path into block dir, in
+//            name order
+static void copy_dir(int dir, const char *path) {
+  struct dirent **names;
+  struct stat st;
+  char *child;
+  int k, n;
+
+  n = scandir(path, &names, NULL, alphasort);
+  if (n < 0) die_path("unable to read directory", path);
+
+  for (k = 0; k < n; k++) {
+    if (strcmp(names[k]->d_name, ".") == 0 || strcmp(names[k]->d_name, "..") == 0) {
+      free(names[k]);
+      continue;
+    }
+    if (strlen(names[k]->d_name) > MAXNAME) die_path("name too long", names[k]->d_name);
+
+    child = malloc(strlen(path) + strlen(names[k]->d_name) + 2);
+    if (!child) die("out of memory");
+    sprintf(child, "%s/%s", path, names[k]->d_name);
+    if (lstat(child, &st) < 0) die_path("unable to stat", child);
+
+    add_entry(dir, names[k]->d_name, copy_entry(child, &st), child);
+    free(child);
+    free(names[k]);
+  }
+  free(names);
+}
+
+int main(int argc, char ** argv) {
+  char *source = NULL;
+  struct stat st;
+  size_t len, done;
+  ssize_t n;
   int i;
-  for (i = 0; i < NUMBLOCKS; i++) {  // write each of the blocks
-    printf("writing : %d\n",i);
+
+  if (argc == 4 && strcmp(argv[1], "-d") == 0) source = argv[2];
+  else if (argc != 2) usage();
+
+  // open the device for reading and writing
+  device_name = argv[argc - 1];
+  device = open(device_name,O_RDWR);
+  if (device < 0) die("unable to open device");
+
+  for (i = 0; i < NUMBLOCKS; i++) {  // fill in each of the blocks
+    memset(&blocks[i], 0, sizeof(struct vvsfs_inode));
+    blocks[i].version = VVSFS_FORMAT_VERSION;
     if (i == 0) {  // the first block is an empty directory
-      inode.is_empty = 0;
-      inode.is_directory = 1;
+      blocks[i].is_empty = 0;
+      blocks[i].is_directory = 1;
+      blocks[i].atime = blocks[i].mtime = blocks[i].ctime = time(NULL);
     } else { //other blocks are all empty.
-      inode.is_empty = 1;
-      inode.is_directory = 0;
+      blocks[i].is_empty = 1;
+      blocks[i].is_directory = 0;
     }
-    inode.size = 0;
-    for (k = 0;k< MAXFILESIZE;k++) inode.data[k] = 0;
+  }
 
+  if (source) {
+    if (stat(source, &st) < 0 || !S_ISDIR(st.st_mode))
+      die_path("not a directory", source);
+    set_times(&blocks[0], &st);
+    copy_dir(0, source);
+    for (queue_head = 0; queue_head < queue_tail; queue_head++) {
+      copy_dir(queue[queue_head].inode_number, queue[queue_head].path);
+      free(queue[queue_head].path);
+    }
+    printf("copied %s : %d of %d blocks used\n", source, next_free, NUMBLOCKS);
+  }
 
-    if (pos != lseek(device,pos,SEEK_SET)) // move the file pointer to the correct block
-      die("seek set failed");
-    if (sizeof(struct vvsfs_inode) != 
-	write(device,&inode,sizeof(struct vvsfs_inode))) // write the block 
-      die("inode write failed");
-    
-    
-    pos += sizeof(struct vvsfs_inode);
+  for (i = 0; i < NUMBLOCKS; i++)
+    blocks[i].csum = vvsfs_block_csum(&blocks[i]);
 
+  // and write the whole image in one go
+  len = sizeof(blocks);
+  for (done = 0; done < len; done += n) {
+    n = pwrite(device, (char *) blocks + done, len - done, done);
+    if (n <= 0) die("image write failed");
   }
-  
-
 
   close(device);
   return 0;
 }
-
@@ -0,0 +1,102 @@
+
+/*
+ * receive.vvsfs - apply a stream written by send.vvsfs (read from standard
+ *                 input) to a copy of the file system
+ *
+ * GPL
+ * To compile :
+ *   gcc receive.vvsfs.c crc32c.c -o receive.vvsfs
+ *
+ * A stream sent with -i only holds the changes after its sequence number, so
+ * the copy must have received everything up to that number and nothing newer
+ * than the stream. The whole stream is checked before the copy is written, in
+ * one go like mkfs.vvsfs. Blocks that are free in the stream are freed in the
+ * copy and all of them are stamped with the stream's last sequence number, so
+ * the copy's highest number is always the one of the last stream it received.
+ * The copy must not be mounted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "vvsfs.h"
+#include "crc32c.h"
+
+char* device_name;
+int device;
+
+static void die(char *mess) {
+  fprintf(stderr,"Exit : %s\n",mess);
+  exit(1);
+}
+
+static void usage(void) {
+   die("Usage : receive.vvsfs <device name>) < stream");
+}
+
+int main(int argc, char ** argv) {
+  struct vvsfs_inode blocks[NUMBLOCKS], block;
+  struct vvsfs_send_header hdr;
+  unsigned int seq = 0;
+  int i, k, n, freed = 0;
+
+  if (argc != 2) usage();
+
+  if (fread(&hdr, sizeof(hdr), 1, stdin) != 1) die("no stream on standard input");
+  if (memcmp(hdr.magic, VVSFS_SEND_MAGIC, sizeof(hdr.magic)) != 0)
+    die("not a send.vvsfs stream");
+  if (hdr.nblocks < 0 || hdr.nblocks > NUMBLOCKS) die("bad stream header");
+
+  device_name = argv[1];
+  device = open(device_name, O_RDWR);
+  if (device < 0) die("unable to open device");
+
+  if (pread(device, blocks, sizeof(blocks), 0) != sizeof(blocks))
+    die("image read failed");
+
+  if (hdr.from != 0) {  // a full stream replaces whatever is there
+    for (i = 0; i < NUMBLOCKS; i++)
+      if (!vvsfs_block_discarded(&blocks[i]) && blocks[i].seq > seq)
+        seq = blocks[i].seq;
+    if (blocks[0].seq_max > seq) seq = blocks[0].seq_max;  // see send.vvsfs
+    if (seq < hdr.from) die("the copy is missing changes, send from an older sequence number");
+    if (seq > hdr.to) die("the copy has changes that are not in the stream");
+  }
+
+  for (k = 0; k < hdr.nblocks; k++) {
+    if (fread(&n, sizeof(n), 1, stdin) != 1 ||
+        fread(&block, sizeof(block), 1, stdin) != 1)
+      die("stream is truncated");
+    if (n < 0 || n >= NUMBLOCKS || (hdr.empty[n / 8] & (1 << (n % 8))))
+      die("bad block number in stream");
+    if (block.csum != vvsfs_block_csum(&block))
+      die("checksum error in stream");
+    blocks[n] = block;
+  }
+
+  // every free block is stamped, also the ones that were free already: the
+  // block that had hdr.to in the sender may have been free here all along
+  for (i = 0; i < NUMBLOCKS; i++) {
+    if (!(hdr.empty[i / 8] & (1 << (i % 8)))) continue;
+    if (vvsfs_block_discarded(&blocks[i]) || !blocks[i].is_empty ||
+        blocks[i].version != VVSFS_FORMAT_VERSION ||
+        blocks[i].csum != vvsfs_block_csum(&blocks[i])) freed++;
+    memset(&blocks[i], 0, sizeof(struct vvsfs_inode));
+    blocks[i].is_empty = 1;
+    blocks[i].version = VVSFS_FORMAT_VERSION;
+    blocks[i].seq = hdr.to;
+    blocks[i].csum = vvsfs_block_csum(&blocks[i]);
+  }
+
+  if (pwrite(device, blocks, sizeof(blocks), 0) != sizeof(blocks))
+    die("image write failed");
+  printf("%s : %d blocks received, %d freed, changes %u to %u\n",
+         device_name, hdr.nblocks, freed, hdr.from, hdr.to);
+
+  close(device);
+  return 0;
+}
@@ -0,0 +1,386 @@
+
+/*
+ * replay.vvsfs - replay a trace recorded by a vvsfs file system mounted with
+ *                the trace option against a mounted vvsfs, and report the
+ *                throughput, the latency and the block I/O of each operation
+ *
+ * GPL
+ * To compile :
+ *   gcc replay.vvsfs.c -o replay.vvsfs
+ *
+ * The trace is the text of vvsfs/trace in debugfs, every line is
+ *   <ns> <pid> <op> <inode> <a1> <a2> <path>
+ * The kernel records an operation when it starts, and every block read and
+ * write with the pid that did it, so the blocks are charged to the last
+ * operation of that pid. Blocks written by the commit work or the reclaim of
+ * removed directories belong to no operation and are counted as background.
+ * A block read from the cache and a write of an unchanged block do not reach
+ * the device, they are counted on their own. The amplification is the number
+ * of device blocks for each operation.
+ *
+ * The kernel keeps the records in a ring and reports the ones it had to
+ * overwrite in "# lost <n>" lines. A trace with lost records misses
+ * operations, so a replay of it would diverge from the recorded tree: it is
+ * refused unless -f is given, and -n warns that the numbers are incomplete.
+ * Load the module with a larger trace_entries, or read the trace more often.
+ *
+ * Operations are replayed as fast as possible, or with -s as far apart as
+ * they were recorded. The replay has to start from the tree the trace was
+ * recorded on (make one with mkfs.vvsfs -d), otherwise operations fail and
+ * are counted as failed. Lookups are replayed with access(2), a lookup of a
+ * name that does not exist yet is not a failure. Attribute changes other than
+ * a new size are replayed as a time update. With -n the trace is only
+ * analysed and nothing is replayed.
+ *
+ *   mount -o loop,trace -t vvsfs fs.raw /mnt
+ *   echo > /sys/kernel/debug/vvsfs/trace ; <workload> ; cat /sys/kernel/debug/vvsfs/trace > t
+ *   replay.vvsfs t /mnt2
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// the operations, in the order the kernel names them (vvsfs_trace_names)
+enum {
+  READBLOCK, WRITEBLOCK, LOOKUP, GETATTR, CREATE, MKDIR, UNLINK, RMDIR, LINK,
+  RENAME, SYMLINK, TO, READ, WRITE, READDIR, SETATTR, FSYNC, NOPS
+};
+const char *names[NOPS] = {
+  "readblock", "writeblock", "lookup", "getattr", "create", "mkdir",
+  "unlink", "rmdir", "link", "rename", "symlink", "to", "read", "write",
+  "readdir", "setattr", "fsync"
+};
+
+// a VFS operation of the trace and the blocks it caused
+struct op {
+  unsigned long long ns;
+  int pid, type;
+  long long a1, a2;
+  char *path, *target;         // target from the "to" record of link, rename and symlink
+  int dev_reads, cached_reads, dev_writes, unchanged_writes;
+  double latency;              // microseconds, when replayed
+  int failed;
+};
+
+struct op *ops;
+int nops, maxops;
+
+// the blocks no operation asked for
+int bg_dev_reads, bg_cached_reads, bg_dev_writes, bg_unchanged_writes;
+
+unsigned long lost;            // records the kernel overwrote before they were read
+
+// the last operation of each pid, block records are charged to it
+struct last_op {
+  int pid, op;
+} last[256];
+int nlast;
+
+char *mount_point;
+int cached_fd = -1;            // the file of the last read, write or fsync
+char *cached_path;
+char *iobuf;
+size_t iobuf_size;
+
+static void die(char *mess) {
+  fprintf(stderr,"Exit : %s\n",mess);
+  exit(1);
+}
+
+static void usage(void) {
+   die("Usage : replay.vvsfs [-s] [-f] <trace> <mount point>) or replay.vvsfs -n <trace>");
+}
+
+// last_op_of - the entry for pid, added if there is none (the oldest is reused)
+static struct last_op *last_op_of(int pid) {
+  int k;
+
+  for (k = 0; k < nlast; k++)
+    if (last[k].pid == pid) return &last[k];
+  k = nlast < 256 ? nlast++ : pid % 256;
+  last[k].pid = pid;
+  last[k].op = -1;
+  return &last[k];
+}
+
+// read_trace - read the trace into ops, charging the block records as it goes
+static void read_trace(const char *name) {
+  char line[256], opname[16];
+  unsigned long long ns;
+  unsigned long ino, k;
+  long long a1, a2;
+  struct last_op *lo;
+  struct op *o;
+  int pid, type, n;
+  int *counter;
+  FILE *f;
+
+  f = fopen(name, "r");
+  if (!f) die("unable to open trace");
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\n")] = 0;
+    if (line[0] == '#') {
+      if (sscanf(line, "# lost %lu", &k) == 1) lost += k;
+      continue;
+    }
+    if (sscanf(line, "%llu %d %15s %lu %lld %lld %n", &ns, &pid, opname, &ino, &a1, &a2, &n) != 6)
+      die("not a vvsfs trace");
+    for (type = 0; type < NOPS && strcmp(names[type], opname) != 0; type++) ;
+    if (type == NOPS) die("unknown operation in trace");
+    lo = last_op_of(pid);
+
+    if (type == READBLOCK || type == WRITEBLOCK) {
+      o = lo->op >= 0 ? &ops[lo->op] : NULL;
+      if (type == READBLOCK && a1) counter = o ? &o->cached_reads : &bg_cached_reads;
+      else if (type == READBLOCK) counter = o ? &o->dev_reads : &bg_dev_reads;
+      else if (a1) counter = o ? &o->unchanged_writes : &bg_unchanged_writes;
+      else counter = o ? &o->dev_writes : &bg_dev_writes;
+      (*counter)++;
+      continue;
+    }
+    if (type == TO) {
+      if (lo->op >= 0 && !ops[lo->op].target)
+        ops[lo->op].target = strdup(line + n);
+      continue;
+    }
+
+    if (nops == maxops) {
+      maxops = maxops ? maxops * 2 : 1024;
+      ops = realloc(ops, maxops * sizeof(struct op));
+      if (!ops) die("out of memory");
+    }
+    o = &ops[nops];
+    memset(o, 0, sizeof(struct op));
+    o->ns = ns;
+    o->pid = pid;
+    o->type = type;
+    o->a1 = a1;
+    o->a2 = a2;
+    o->path = strdup(line + n);
+    if (!o->path) die("out of memory");
+    lo->op = nops++;
+  }
+  fclose(f);
+  if (nops == 0) die("no operations in trace");
+}
+
+static double now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// full_path - the path in the mounted file system, path starts with a /
+static char *full_path(const char *path) {
+  char *p = malloc(strlen(mount_point) + strlen(path) + 1);
+
+  if (!p) die("out of memory");
+  sprintf(p, "%s%s", mount_point, path);
+  return p;
+}
+
+static void close_cached(void) {
+  if (cached_fd >= 0) close(cached_fd);
+  cached_fd = -1;
+  free(cached_path);
+  cached_path = NULL;
+}
+
+// open_cached - the file at p, kept open while the trace stays on it
+static int open_cached(const char *p) {
+  if (cached_fd >= 0 && strcmp(cached_path, p) == 0) return cached_fd;
+  close_cached();
+  cached_fd = open(p, O_RDWR);
+  if (cached_fd < 0) cached_fd = open(p, O_RDONLY);  // a directory or a read only file
+  if (cached_fd >= 0) cached_path = strdup(p);
+  return cached_fd;
+}
+
+static void grow_iobuf(size_t count) {
+  if (count <= iobuf_size) return;
+  iobuf = realloc(iobuf, count);
+  if (!iobuf) die("out of memory");
+  memset(iobuf, 'v', count);
+  iobuf_size = count;
+}
+
+// replay_op - do the operation o, returns -1 if it failed
+static int replay_op(struct op *o) {
+  char *p, *t = NULL;
+  struct dirent *de;
+  DIR *dir;
+  int fd, err = 0;
+
+  if (strcmp(o->path, "?") == 0) return -1;  // the path did not fit in the record
+  p = full_path(o->path);
+  if (o->target && o->type != SYMLINK) t = full_path(o->target);
+
+  switch (o->type) {
+  case LOOKUP:
+    if (access(p, F_OK) < 0 && errno != ENOENT) err = -1;
+    break;
+  case GETATTR: {
+    struct stat st;
+    err = lstat(p, &st);
+    break;
+  }
+  case CREATE:
+    fd = open(p, O_CREAT | O_EXCL | O_WRONLY, 0666);
+    if (fd < 0) err = -1;
+    else close(fd);
+    break;
+  case MKDIR:
+    err = mkdir(p, 0777);
+    break;
+  case UNLINK:
+  case RMDIR:
+  case RENAME:
+    close_cached();  // the cached file may be the one going
+    if (o->type == UNLINK) err = unlink(p);
+    else if (o->type == RMDIR) err = rmdir(p);
+    else if (!t) err = -1;
+#ifdef SYS_renameat2
+    else if (o->a1) err = syscall(SYS_renameat2, AT_FDCWD, p, AT_FDCWD, t, (unsigned) o->a1);
+#endif
+    else err = rename(p, t);
+    break;
+  case LINK:
+    err = t ? link(p, t) : -1;
+    break;
+  case SYMLINK:
+    err = o->target ? symlink(o->target, p) : -1;
+    break;
+  case READ:
+  case WRITE:
+    fd = open_cached(p);
+    if (fd < 0) { err = -1; break; }
+    grow_iobuf(o->a2);
+    if (o->type == READ) err = pread(fd, iobuf, o->a2, o->a1) < 0 ? -1 : 0;
+    else err = pwrite(fd, iobuf, o->a2, o->a1) < 0 ? -1 : 0;
+    break;
+  case READDIR:
+    dir = opendir(p);
+    if (!dir) { err = -1; break; }
+    while ((de = readdir(dir)) != NULL) ;
+    closedir(dir);
+    break;
+  case SETATTR:
+    if (o->a1 >= 0) err = truncate(p, o->a1);
+    else err = utimensat(AT_FDCWD, p, NULL, AT_SYMLINK_NOFOLLOW);
+    break;
+  case FSYNC:
+    fd = open_cached(p);
+    err = fd < 0 || fsync(fd) < 0 ? -1 : 0;
+    break;
+  }
+  free(p);
+  free(t);
+  return err < 0 ? -1 : 0;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+// report - a line for each kind of operation and one for all of them
+static void report(int replayed) {
+  static double lat[NOPS + 1][1 << 16];  // sorted for the percentiles, a sample if there are more
+  int count[NOPS + 1], failed[NOPS + 1], n[NOPS + 1];
+  long dev[NOPS + 1], cached[NOPS + 1];
+  double sum[NOPS + 1];
+  int i, k, type;
+
+  memset(count, 0, sizeof(count));
+  memset(failed, 0, sizeof(failed));
+  memset(n, 0, sizeof(n));
+  memset(dev, 0, sizeof(dev));
+  memset(cached, 0, sizeof(cached));
+  memset(sum, 0, sizeof(sum));
+  for (i = 0; i < nops; i++) {
+    struct op *o = &ops[i];
+    int both[2] = { o->type, NOPS };
+    for (k = 0; k < 2; k++) {
+      type = both[k];
+      count[type]++;
+      failed[type] += o->failed;
+      dev[type] += o->dev_reads + o->dev_writes;
+      cached[type] += o->cached_reads + o->unchanged_writes;
+      sum[type] += o->latency;
+      if (n[type] < (1 << 16)) lat[type][n[type]++] = o->latency;
+    }
+  }
+
+  printf("%-9s %7s %6s %9s %9s %9s %9s %9s %9s\n", "op", "count", "failed",
+         "avg us", "p50 us", "p99 us", "max us", "dev blk", "cached");
+  for (type = 0; type <= NOPS; type++) {
+    if (!count[type]) continue;
+    qsort(lat[type], n[type], sizeof(double), cmp_double);
+    printf("%-9s %7d %6d", type == NOPS ? "all" : names[type], count[type], failed[type]);
+    if (replayed)
+      printf(" %9.1f %9.1f %9.1f %9.1f", sum[type] / count[type], lat[type][n[type] / 2],
+             lat[type][n[type] * 99 / 100], lat[type][n[type] - 1]);
+    else
+      printf(" %9s %9s %9s %9s", "-", "-", "-", "-");
+    // blocks for each operation, the amplification of the logical operations
+    printf(" %9.2f %9.2f\n", (double) dev[type] / count[type],
+           (double) cached[type] / count[type]);
+  }
+  printf("background : %d device reads, %d device writes, %d from the cache or unchanged\n",
+         bg_dev_reads, bg_dev_writes, bg_cached_reads + bg_unchanged_writes);
+}
+
+int main(int argc, char ** argv) {
+  int keep_timing = 0, analyse_only = 0, force = 0;
+  double start, end, due;
+  int i, failed = 0;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-n") == 0) analyse_only = 1;
+    else if (strcmp(argv[i], "-s") == 0) keep_timing = 1;
+    else if (strcmp(argv[i], "-f") == 0) force = 1;
+    else usage();
+  }
+  if (analyse_only ? (keep_timing || force || argc - i != 1) : argc - i != 2) usage();
+
+  read_trace(argv[i]);
+  printf("%d operations recorded in %.3f s\n", nops,
+         (ops[nops - 1].ns - ops[0].ns) / 1e9);
+  if (lost) {
+    fprintf(stderr, "%lu records were overwritten before the trace was read\n", lost);
+    if (!analyse_only && !force)
+      die("the trace is incomplete, replay it anyway with -f");
+  }
+
+  if (!analyse_only) {
+    mount_point = argv[argc - 1];
+    start = now_us();
+    for (i = 0; i < nops; i++) {
+      if (keep_timing) {
+        due = start + (ops[i].ns - ops[0].ns) / 1e3;
+        while (now_us() < due) usleep(due - now_us());
+      }
+      ops[i].latency = now_us();
+      ops[i].failed = replay_op(&ops[i]) < 0;
+      ops[i].latency = now_us() - ops[i].latency;
+      failed += ops[i].failed;
+    }
+    close_cached();
+    end = now_us();
+    printf("%d operations replayed in %.3f s, %.0f ops/s, %d failed\n", nops,
+           (end - start) / 1e6, nops / ((end - start) / 1e6), failed);
+  }
+  report(!analyse_only);
+  return 0;
+}
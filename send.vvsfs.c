@@ -0,0 +1,93 @@
+
+/*
+ * send.vvsfs - write the blocks of a vvsfs file system that changed since a
+ *              sequence number to standard output, for receive.vvsfs
+ *
+ * GPL
+ * To compile :
+ *   gcc send.vvsfs.c crc32c.c -o send.vvsfs
+ *
+ * Every block write stamps the block with the next change sequence number
+ * (vvsfs_writeblock), so the blocks changed since the last backup are the ones
+ * with a higher number than the one that backup reported. Without -i every
+ * block in use is sent. Free blocks are not sent, a bitmap of them is in the
+ * header, which also covers blocks that were discarded. The file system must
+ * not be mounted (or must be mounted read only after a sync).
+ *
+ *   send.vvsfs <device> | receive.vvsfs <copy>             (the first time)
+ *   send.vvsfs -i <to> <device> | receive.vvsfs <copy>     (every time after)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "vvsfs.h"
+#include "crc32c.h"
+
+char* device_name;
+int device;
+
+static void die(char *mess) {
+  fprintf(stderr,"Exit : %s\n",mess);
+  exit(1);
+}
+
+static void usage(void) {
+   die("Usage : send.vvsfs [-i <sequence number>] <device name>)");
+}
+
+int main(int argc, char ** argv) {
+  struct vvsfs_inode blocks[NUMBLOCKS];
+  struct vvsfs_send_header hdr;
+  unsigned int from = 0;
+  int i;
+
+  if (argc == 4 && strcmp(argv[1], "-i") == 0) from = strtoul(argv[2], NULL, 10);
+  else if (argc != 2) usage();
+
+  device_name = argv[argc - 1];
+  device = open(device_name, O_RDONLY);
+  if (device < 0) die("unable to open device");
+
+  if (pread(device, blocks, sizeof(blocks), 0) != sizeof(blocks))
+    die("image read failed");
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, VVSFS_SEND_MAGIC, sizeof(hdr.magic));
+  hdr.from = from;
+  for (i = 0; i < NUMBLOCKS; i++) {
+    if (vvsfs_block_discarded(&blocks[i])) {  // an empty block after a discard
+      blocks[i].is_empty = 1;
+    } else if (blocks[i].csum != vvsfs_block_csum(&blocks[i])) {
+      die("checksum errors, run fsck.vvsfs");
+    }
+    if (blocks[i].seq > hdr.to) hdr.to = blocks[i].seq;
+    if (blocks[i].is_empty)
+      hdr.empty[i / 8] |= 1 << (i % 8);
+    else if (from == 0 || blocks[i].seq > from)
+      hdr.nblocks++;
+  }
+  // numbers handed out before a discard, the blocks no longer show them
+  if (blocks[0].seq_max > hdr.to) hdr.to = blocks[0].seq_max;
+  if (from > hdr.to)
+    die("the sequence number is newer than the file system");
+
+  if (fwrite(&hdr, sizeof(hdr), 1, stdout) != 1) die("write failed");
+  for (i = 0; i < NUMBLOCKS; i++) {
+    if (blocks[i].is_empty || (from != 0 && blocks[i].seq <= from)) continue;
+    if (fwrite(&i, sizeof(i), 1, stdout) != 1 ||
+        fwrite(&blocks[i], sizeof(struct vvsfs_inode), 1, stdout) != 1)
+      die("write failed");
+  }
+  if (fflush(stdout) != 0) die("write failed");
+
+  // the number to give -i next time
+  fprintf(stderr, "%s : %d of %d blocks sent, changes %u to %u\n",
+          device_name, hdr.nblocks, NUMBLOCKS, from, hdr.to);
+  close(device);
+  return 0;
+}
@@ -0,0 +1,11 @@
+----------
+file2
+hello
+----------
+dir1
+file3
+hello
+----------
+file3
+by
+----------
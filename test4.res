@@ -0,0 +1,9 @@
+----------
+v1
+one
+----------
+two
+current
+v1
+v2
+----------
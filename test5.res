@@ -0,0 +1,10 @@
+----------
+full stream received
+----------
+incremental stream received
+----------
+incremental stream received
+file1
+file3
+one
+three
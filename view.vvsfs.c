@@ -35,32 +35,37 @@ int main(int argc, char ** argv) {
   
   off_t pos=0;
   struct vvsfs_inode inode;
-  int i;
+  int i, k;
   for (i = 0; i < NUMBLOCKS; i++) {  // read each of the blocks
 
     if (pos != lseek(device,pos,SEEK_SET)) 
       die("seek set failed");
     if (sizeof(struct vvsfs_inode) != read(device,&inode,sizeof(struct vvsfs_inode))) 
       die("inode read failed");
+    for (k = 0; k < BLOCKSIZE && ((char *) &inode)[k] == 0; k++)
+      ;
+    if (k == BLOCKSIZE) inode.is_empty = 1;  // discarded, reads back as zeros
 
-    printf("%2d : empty : %s dir : %s size : %i data : ", i, 
+    printf("%2d : empty : %s dir : %s size : %llu data : ", i, 
                        (inode.is_empty?"T":"F"), 
                        (inode.is_directory?"T":"F"), 
-                       inode.size);
+                       (unsigned long long) inode.size);
 
 
     if (inode.is_directory) {
       int k, nodirs;
       struct vvsfs_dir_entry *dent = (struct vvsfs_dir_entry *) inode.data;
-      nodirs = inode.size/sizeof(struct vvsfs_dir_entry);
+      nodirs = MIN(inode.size, MAXFILESIZE)/sizeof(struct vvsfs_dir_entry);
       for (k=0;k<nodirs;k++) {
-        printf("%s : %d ",dent->name, dent->inode_number);
+        printf("%s : %u ",dent->name, dent->inode_number);
 		dent++;
       }
       printf("\n");
+    } else if (inode.flags & VVSFS_FL_COMPRESSED) {
+       printf("(lz4 compressed, %u bytes on disk)\n", inode.csize);
     } else {
        int j;
-       for (j=0;j< inode.size;j++) {
+       for (j=0;j< MIN(inode.size, MAXFILESIZE);j++) {
          if (inode.data[j] == '\n') {
            printf("\\n");
 	 } else {
@@ -57,18 +57,112 @@
 #include <linux/version.h>
 #include <asm/uaccess.h>
 #include <linux/seq_file.h>
+#include <linux/parser.h>
+#include <linux/lz4.h>
+#include <linux/crc32c.h>
+#include <linux/file.h>
+#include <linux/workqueue.h>
+#include <linux/falloc.h>
+#include <linux/xattr.h>
+#include <linux/debugfs.h>
+#include <linux/vmalloc.h>
 
 #include "vvsfs.h"
+#include "vvsfs_lib.c"  // the block level helpers, also linked into the KUnit module
 
-#define DEBUG 1
+static int vvsfs_debug = 1;  // the default for debug=<level>, and where there is no super block
+module_param_named(debug, vvsfs_debug, int, 0644);
+MODULE_PARM_DESC(debug, "printk tracing for new mounts, 0 turns it off");
+#define DEBUG vvsfs_debug
+#define DEBUG_SB(sb) (VVSFS_SB(sb)->s_debug)  // the debug=<level> of that mount
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)  // do not overwrite the target
+#define RENAME_EXCHANGE  (1 << 1)  // swap the source and the target
+#endif
+
+#ifndef FALLOC_FL_ZERO_RANGE
+#define FALLOC_FL_ZERO_RANGE 0x10  // from 3.15 on
+#endif
+
+#ifndef FICLONE
+// the same numbers as BTRFS_IOC_CLONE and BTRFS_IOC_CLONE_RANGE, used by cp --reflink
+struct file_clone_range {
+  __s64 src_fd;
+  __u64 src_offset;
+  __u64 src_length;
+  __u64 dest_offset;
+};
+#define FICLONE      _IOW(0x94, 9, int)
+#define FICLONERANGE _IOW(0x94, 13, struct file_clone_range)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,5,0)
+// i_mutex is taken through these from 4.5 on, it is the i_rwsem from 4.7
+static inline void inode_lock(struct inode *inode)
+{
+  mutex_lock(&inode->i_mutex);
+}
+
+static inline void inode_unlock(struct inode *inode)
+{
+  mutex_unlock(&inode->i_mutex);
+}
+
+static inline void inode_lock_nested(struct inode *inode, unsigned subclass)
+{
+  mutex_lock_nested(&inode->i_mutex, subclass);
+}
+#endif
+
+// mount options
+#define VVSFS_MOUNT_COMPRESS 0x1  // new files are created with VVSFS_FL_COMPRESS
+#define VVSFS_MOUNT_NOCSUM   0x2  // do not verify block checksums when reading
+#define VVSFS_MOUNT_ASYNC    0x4  // leave dirty blocks to the commit work
+#define VVSFS_MOUNT_NOATIME  0x8  // do not update access times
+#define VVSFS_MOUNT_LAZYTIME 0x10 // keep time only updates in memory
+#define VVSFS_MOUNT_DISCARD  0x20 // discard freed blocks
+#define VVSFS_MOUNT_TRACE    0x40 // record operations and block I/O for replay.vvsfs
+
+#define VVSFS_DEFAULT_COMMIT    5  // seconds between flushes with async
+#define VVSFS_DEFAULT_READAHEAD 32 // inode blocks, more than a directory has entries
+#define VVSFS_MAX_COMMIT        3600  // seconds, so the interval in jiffies can not overflow
+
+// vvsfs_sb_info - the per mount information kept in the VFS super block.
+//                 The options are read on every block access, the counters
+//                 are written by every allocation and block write, so the
+//                 counters get a cache line of their own.
+struct vvsfs_sb_info {
+  unsigned int s_mount_opt;
+  int s_commit_interval;               // seconds, with VVSFS_MOUNT_ASYNC
+  int s_inode_readahead;               // inode blocks read ahead by readdir, 0 for none
+  int s_debug;                         // debug=<level>, the printk tracing of this mount
+  struct super_block *s_sb;
+  atomic_t s_free_blocks ____cacheline_aligned_in_smp;  // for statfs
+  atomic_t s_seq;                      // the last change sequence number handed out
+  unsigned int s_seq_max;              // seq_max of block 0, under its buffer lock
+  unsigned long s_dirty[BITS_TO_LONGS(NUMBLOCKS)];  // written with async, not committed yet
+  struct work_struct s_reclaim_work ____cacheline_aligned_in_smp;   // frees removed directory trees in the background
+  struct delayed_work s_commit_work;   // writes the dirty blocks back with async
+  struct mutex s_alloc_mutex;          // allocation against FITRIM and discard
+  unsigned long s_discard_pending[BITS_TO_LONGS(NUMBLOCKS)];  // freed, not yet discarded
+  struct delayed_work s_discard_work;  // discards them in batches
+};
+
+static inline struct vvsfs_sb_info *VVSFS_SB(struct super_block *sb) {
+  return sb->s_fs_info;
+}
 
 static struct inode_operations vvsfs_file_inode_operations;
 static struct file_operations vvsfs_file_operations;
 static struct super_operations vvsfs_ops;
 static struct file_operations vvsfs_dir_operations;
 static struct inode_operations vvsfs_dir_inode_operations;
+static struct inode_operations vvsfs_symlink_inode_operations;
 struct inode * vvsfs_new_inode(const struct inode *, umode_t);
 static int vvsfs_unlink(struct inode *, struct dentry *);
+static int vvsfs_update_time(struct inode *, struct timespec *, int);
+static int vvsfs_defrag_dir(struct inode *);
 static struct super_block * sb;
 
 int vvsfs_find_hard_link(struct inode *, struct dentry *);
@@ -78,68 +172,592 @@ static int vvsfs_fill_super(struct super_block *, void *, int);
 struct inode *vvsfs_iget(struct super_block *sb, unsigned long ino);
 static void
 vvsfs_put_super(struct super_block *sb) {
-  if (DEBUG) printk("vvsfs - put_super\n");
+  if (DEBUG_SB(sb)) printk("vvsfs - put_super\n");
+  // finish freeing the directories removed before the unmount
+  flush_work(&VVSFS_SB(sb)->s_reclaim_work);
+  flush_delayed_work(&VVSFS_SB(sb)->s_discard_work);
+  cancel_delayed_work_sync(&VVSFS_SB(sb)->s_commit_work);
+  sync_blockdev(sb->s_bdev);
+  kfree(sb->s_fs_info);
+  sb->s_fs_info = NULL;
   return;
 }
 
 static int 
 vvsfs_statfs(struct dentry *dentry, struct kstatfs *buf) {
-  if (DEBUG) printk("vvsfs - statfs\n");
+  struct vvsfs_sb_info *sbi = VVSFS_SB(dentry->d_sb);
+
+  if (DEBUG_SB(dentry->d_sb)) printk("vvsfs - statfs\n");
 
+  // every block is an inode, so the block and inode counts are the same
+  buf->f_bsize = BLOCKSIZE;
+  buf->f_blocks = NUMBLOCKS;
+  buf->f_bfree = buf->f_bavail = atomic_read(&sbi->s_free_blocks);
+  buf->f_files = NUMBLOCKS;
+  buf->f_ffree = atomic_read(&sbi->s_free_blocks);
   buf->f_namelen = MAXNAME;
   return 0;
 }
 
+// vvsfs_csum - the CRC32C of a block, calculated as if its csum field was zero
+static u32
+vvsfs_csum(const struct vvsfs_inode *inode) {
+  const u32 zero = 0;
+  const unsigned int off = offsetof(struct vvsfs_inode, csum);
+  u32 crc;
+
+  crc = crc32c(~0, inode, off);
+  crc = crc32c(crc, &zero, sizeof(zero));
+  return crc32c(crc, (const char *) inode + off + sizeof(zero),
+                BLOCKSIZE - off - sizeof(zero));
+}
+
+// The trace recorder. With the trace mount option every VFS operation and
+// every block read and write is added to a ring of records, which is read as
+// text from vvsfs/trace in debugfs (writing to it empties the ring). One ring
+// is shared by all mounts, it is only allocated by the first trace mount.
+// Operations are recorded when they start, block I/O carries the pid, so
+// replay.vvsfs can charge the blocks to the operation that caused them.
+// When the ring is full the oldest records are overwritten, the trace says
+// how many were lost in "# lost <n>" lines.
+#define VVSFS_TRACE_PATH    96    // longer paths are cut
+
+static unsigned int vvsfs_trace_entries = 4096;  // records in the ring
+module_param_named(trace_entries, vvsfs_trace_entries, uint, 0444);
+MODULE_PARM_DESC(trace_entries, "records kept by the trace mount option");
+
+enum {
+  VVSFS_TRACE_READBLOCK, VVSFS_TRACE_WRITEBLOCK, VVSFS_TRACE_LOOKUP,
+  VVSFS_TRACE_GETATTR, VVSFS_TRACE_CREATE, VVSFS_TRACE_MKDIR,
+  VVSFS_TRACE_UNLINK, VVSFS_TRACE_RMDIR, VVSFS_TRACE_LINK,
+  VVSFS_TRACE_RENAME, VVSFS_TRACE_SYMLINK, VVSFS_TRACE_TO,
+  VVSFS_TRACE_READ, VVSFS_TRACE_WRITE, VVSFS_TRACE_READDIR,
+  VVSFS_TRACE_SETATTR, VVSFS_TRACE_FSYNC
+};
+
+// the names in the trace, in the order above
+static const char *vvsfs_trace_names[] = {
+  "readblock", "writeblock", "lookup", "getattr", "create", "mkdir",
+  "unlink", "rmdir", "link", "rename", "symlink", "to", "read", "write",
+  "readdir", "setattr", "fsync"
+};
+
+struct vvsfs_trace_rec {
+  u64 ns;                        // ktime, nanoseconds since boot
+  pid_t pid;
+  int op;
+  unsigned long ino;             // the block for block I/O
+  long long a1, a2;              // offset and count for read and write, the size for setattr
+  char path[VVSFS_TRACE_PATH];   // from the root of the file system, or a link target
+};
+
+static struct vvsfs_trace_rec *vvsfs_trace_buf;
+static unsigned long vvsfs_trace_head;  // records added since the ring was emptied, the
+                                        // ones before head - vvsfs_trace_entries are lost
+static DEFINE_SPINLOCK(vvsfs_trace_lock);
+static DEFINE_MUTEX(vvsfs_trace_mutex); // allocation of the ring
+static struct dentry *vvsfs_debugfs;
+
+// vvsfs_trace_alloc - allocate the ring for a trace mount, it is kept until
+//                     the module is removed
+static int
+vvsfs_trace_alloc(void) {
+  if (vvsfs_trace_entries == 0 ||
+      vvsfs_trace_entries > ULONG_MAX / sizeof(struct vvsfs_trace_rec)) {
+    printk("vvsfs - bad trace_entries %u\n", vvsfs_trace_entries);
+    return -EINVAL;
+  }
+  mutex_lock(&vvsfs_trace_mutex);
+  if (!vvsfs_trace_buf)
+    vvsfs_trace_buf = vzalloc((unsigned long) vvsfs_trace_entries * sizeof(struct vvsfs_trace_rec));
+  mutex_unlock(&vvsfs_trace_mutex);
+  return vvsfs_trace_buf ? 0 : -ENOMEM;
+}
+
+static inline int
+vvsfs_tracing(struct super_block *sb) {
+  return VVSFS_SB(sb)->s_mount_opt & VVSFS_MOUNT_TRACE;
+}
+
+// vvsfs_trace - add a record to the ring
+static void
+vvsfs_trace(int op, unsigned long ino, long long a1, long long a2, const char *path) {
+  struct vvsfs_trace_rec *r;
+  unsigned long flags;
+
+  spin_lock_irqsave(&vvsfs_trace_lock, flags);
+  r = &vvsfs_trace_buf[vvsfs_trace_head++ % vvsfs_trace_entries];
+  r->ns = ktime_to_ns(ktime_get());
+  r->pid = task_pid_nr(current);
+  r->op = op;
+  r->ino = ino;
+  r->a1 = a1;
+  r->a2 = a2;
+  strlcpy(r->path, path ? path : "", VVSFS_TRACE_PATH);
+  spin_unlock_irqrestore(&vvsfs_trace_lock, flags);
+}
+
+// vvsfs_trace_block - record a block read or write, a1 is 1 when the device
+//                     was not touched (a read from the cache, an unchanged write)
+static inline void
+vvsfs_trace_block(struct super_block *sb, int op, unsigned long inum, int cached) {
+  if (vvsfs_tracing(sb))
+    vvsfs_trace(op, inum, cached, 0, NULL);
+}
+
+// vvsfs_trace_dentry - record an operation on the name dentry
+static void
+vvsfs_trace_dentry(int op, struct dentry *dentry, long long a1, long long a2) {
+  char buf[VVSFS_TRACE_PATH];
+  char *path;
+
+  if (!vvsfs_tracing(dentry->d_sb)) return;
+  path = dentry_path_raw(dentry, buf, sizeof(buf));
+  vvsfs_trace(op, dentry->d_inode ? dentry->d_inode->i_ino : 0, a1, a2,
+              IS_ERR(path) ? "?" : path);
+}
+
+// records overwritten while the trace file was being read
+struct vvsfs_trace_iter {
+  unsigned long lost;
+  void *at;  // the record the "# lost" line goes in front of
+};
+
+// vvsfs_trace_start - the records still in the ring from *pos on. Position 0
+//                     is the "# lost" header, position n + 1 is the record
+//                     added n-th since the ring was last emptied. Records
+//                     overwritten before they are read are skipped and counted.
+static void *
+vvsfs_trace_start(struct seq_file *m, loff_t *pos) {
+  struct vvsfs_trace_iter *it = m->private;
+  unsigned long first = 0;
+
+  if (!vvsfs_trace_buf) return NULL;
+  if (*pos == 0) return SEQ_START_TOKEN;
+  if (vvsfs_trace_head > vvsfs_trace_entries)
+    first = vvsfs_trace_head - vvsfs_trace_entries;
+  if (*pos - 1 < first) {  // overwritten while reading
+    it->lost = (it->at ? it->lost : 0) + first - (*pos - 1);
+    it->at = &vvsfs_trace_buf[first % vvsfs_trace_entries];
+    *pos = first + 1;
+  }
+  if (*pos - 1 >= vvsfs_trace_head) return NULL;
+  return &vvsfs_trace_buf[(*pos - 1) % vvsfs_trace_entries];
+}
+
+static void *
+vvsfs_trace_next(struct seq_file *m, void *v, loff_t *pos) {
+  ++*pos;
+  return vvsfs_trace_start(m, pos);
+}
+
+static void
+vvsfs_trace_stop(struct seq_file *m, void *v) {
+}
+
+// vvsfs_trace_show - one line per record, the path last as it may hold spaces.
+//                    The first line counts the records overwritten before the
+//                    read started, a later "# lost" line the ones overwritten
+//                    while reading.
+static int
+vvsfs_trace_show(struct seq_file *m, void *v) {
+  struct vvsfs_trace_iter *it = m->private;
+  struct vvsfs_trace_rec r;
+  unsigned long flags, lost = 0;
+
+  if (v == SEQ_START_TOKEN) {
+    spin_lock_irqsave(&vvsfs_trace_lock, flags);
+    if (vvsfs_trace_head > vvsfs_trace_entries)
+      lost = vvsfs_trace_head - vvsfs_trace_entries;
+    spin_unlock_irqrestore(&vvsfs_trace_lock, flags);
+    seq_printf(m, "# lost %lu\n", lost);
+    return 0;
+  }
+  if (v == it->at)  // kept until the next record, show runs again if the line did not fit
+    seq_printf(m, "# lost %lu\n", it->lost);
+  else
+    it->at = NULL;
+  spin_lock_irqsave(&vvsfs_trace_lock, flags);
+  r = *(struct vvsfs_trace_rec *) v;
+  spin_unlock_irqrestore(&vvsfs_trace_lock, flags);
+  seq_printf(m, "%llu %d %s %lu %lld %lld %s\n", r.ns, r.pid,
+             vvsfs_trace_names[r.op], r.ino, r.a1, r.a2, r.path);
+  return 0;
+}
+
+static const struct seq_operations vvsfs_trace_seq_ops = {
+  .start = vvsfs_trace_start,
+  .next  = vvsfs_trace_next,
+  .stop  = vvsfs_trace_stop,
+  .show  = vvsfs_trace_show,
+};
+
+static int
+vvsfs_trace_open(struct inode *inode, struct file *file) {
+  return seq_open_private(file, &vvsfs_trace_seq_ops, sizeof(struct vvsfs_trace_iter));
+}
+
+// vvsfs_trace_clear - any write empties the ring
+static ssize_t
+vvsfs_trace_clear(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+  unsigned long flags;
+
+  spin_lock_irqsave(&vvsfs_trace_lock, flags);
+  vvsfs_trace_head = 0;
+  spin_unlock_irqrestore(&vvsfs_trace_lock, flags);
+  return count;
+}
+
+static const struct file_operations vvsfs_trace_fops = {
+  .owner   = THIS_MODULE,
+  .open    = vvsfs_trace_open,
+  .read    = seq_read,
+  .write   = vvsfs_trace_clear,
+  .llseek  = seq_lseek,
+  .release = seq_release_private,
+};
+
 // vvsfs_readblock - reads a block from the block device (this will copy over
-//                      the top of inode)
+//                      the top of inode). Returns -EIO if the block can not be
+//                      read or its checksum does not match.
 static int
-vvsfs_readblock(struct super_block *sb, int inum, struct vvsfs_inode *inode) {  // reference to a super block sitting in the VFS;inode number ;the block of inode you are reading
+vvsfs_readblock(struct super_block *sb, unsigned long inum, struct vvsfs_inode *inode) {  // reference to a super block sitting in the VFS;inode number ;the block of inode you are reading
   struct buffer_head *bh;
 
-  if (DEBUG) printk("vvsfs - readblock : %d\n", inum);
+  if (DEBUG_SB(sb)) printk("vvsfs - readblock : %lu\n", inum);
+  if (vvsfs_tracing(sb)) {
+    bh = sb_find_get_block(sb, inum);
+    vvsfs_trace_block(sb, VVSFS_TRACE_READBLOCK, inum, bh && buffer_uptodate(bh));
+    brelse(bh);
+  }
+  if (inum >= NUMBLOCKS) {  // a damaged directory entry
+    printk("vvsfs - block %lu is outside the inode table\n", inum);
+    return -EIO;
+  }
   
   bh = sb_bread(sb,inum);//initiate the block read of super block, bh is buffer head, stores the information about the buffer
+  if (!bh) {
+    printk("vvsfs - unable to read block %lu\n", inum);
+    return -EIO;
+  }
 
-  // bh->b_data is part of information of that buffer
+  // bh->b_data is part of information of that buffer. The writers change it
+  // under the buffer lock, without it the copy can be half old, half new.
+  lock_buffer(bh);
   memcpy((void *) inode, (void *) bh->b_data, BLOCKSIZE); //copy the b_data to the inode struct
+  unlock_buffer(bh);
 
   brelse(bh);//release the buffer head. if not, will cause memory leak.
-  if (DEBUG) printk("vvsfs - readblock done : %d\n", inum);
+
+  if (!memchr_inv(inode, 0, BLOCKSIZE)) {
+    // a discarded block reads back as zeros, that is an empty block
+    inode->is_empty = true;
+    inode->csum = vvsfs_csum(inode);
+  }
+  if (!(VVSFS_SB(sb)->s_mount_opt & VVSFS_MOUNT_NOCSUM) &&
+      inode->csum != vvsfs_csum(inode)) {
+    printk("vvsfs - checksum error in block %lu\n", inum);
+    return -EIO;
+  }
+  if (vvsfs_check_block(inode) < 0) {  // also with nocsum, the sizes are trusted from here on
+    printk("vvsfs - bad sizes in block %lu\n", inum);
+    return -EIO;
+  }
+  if (DEBUG_SB(sb)) printk("vvsfs - readblock done : %lu\n", inum);
   return BLOCKSIZE;
 }
 
+// vvsfs_sb_read - vvsfs_readblock for the helpers that take a block reader
+//                 (vvsfs_find_empty, vvsfs_count_names), so the KUnit tests
+//                 can run them on an image in memory
+static int
+vvsfs_sb_read(void *sb, unsigned long inum, struct vvsfs_inode *block) {
+  return vvsfs_readblock(sb, inum, block);
+}
+
+// vvsfs_sync_writes - whether blocks are written through to the disk
+static inline int
+vvsfs_sync_writes(struct super_block *sb) {
+  return !(VVSFS_SB(sb)->s_mount_opt & VVSFS_MOUNT_ASYNC) ||
+         (sb->s_flags & MS_SYNCHRONOUS);
+}
+
+// vvsfs_schedule_commit - note a block dirtied with async and make sure the
+//                         commit work runs within the commit interval, it is
+//                         only queued by the first dirty block
+static void
+vvsfs_schedule_commit(struct super_block *sb, unsigned long inum) {
+  struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+
+  set_bit(inum, sbi->s_dirty);
+  queue_delayed_work(system_long_wq, &sbi->s_commit_work,
+                     sbi->s_commit_interval * HZ);
+}
+
+// vvsfs_flush_dirty - write the blocks noted by vvsfs_schedule_commit and wait
+//                     for them. All writes are started in block order under one
+//                     plug, so the block layer merges runs of neighbouring
+//                     blocks (an inode table run) into single requests, and
+//                     only then waited for, instead of a write and a wait for
+//                     each block
+static int
+vvsfs_flush_dirty(struct super_block *sb) {
+  struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+  struct buffer_head **bhs;
+  struct buffer_head *bh;
+  struct blk_plug plug;
+  int k, n = 0, err = 0;
+
+  bhs = kcalloc(NUMBLOCKS, sizeof(struct buffer_head *), GFP_NOFS);
+  if (!bhs)
+    return sync_blockdev(sb->s_bdev);
+
+  blk_start_plug(&plug);
+  for (k = 0; k < NUMBLOCKS; k++) {
+    if (!test_and_clear_bit(k, sbi->s_dirty)) continue;
+    bh = sb_find_get_block(sb, k);
+    if (!bh) continue;  // written back and dropped by the VM already
+    write_dirty_buffer(bh, WRITE);  // nothing if it is clean by now
+    bhs[n++] = bh;
+  }
+  blk_finish_plug(&plug);
+
+  for (k = 0; k < n; k++) {
+    wait_on_buffer(bhs[k]);
+    if (!buffer_uptodate(bhs[k]))
+      err = -EIO;
+    brelse(bhs[k]);
+  }
+  kfree(bhs);
+  if (DEBUG_SB(sb)) printk("vvsfs - flushed %d blocks\n", n);
+  return err;
+}
+
+// vvsfs_commit_work - write back everything dirtied since the last commit
+static void
+vvsfs_commit_work(struct work_struct *work) {
+  struct vvsfs_sb_info *sbi = container_of(to_delayed_work(work),
+                                           struct vvsfs_sb_info, s_commit_work);
+
+  if (DEBUG_SB(sbi->s_sb)) printk("vvsfs - commit\n");
+  vvsfs_flush_dirty(sbi->s_sb);
+}
+
+// vvsfs_fsync - with async the blocks of a file may still be dirty in the
+//               block device's cache, write them out
+static int
+vvsfs_fsync(struct file *file, loff_t start, loff_t end, int datasync) {
+  vvsfs_trace_dentry(VVSFS_TRACE_FSYNC, file->f_path.dentry, datasync, 0);
+  return vvsfs_flush_dirty(file_inode(file)->i_sb);
+}
+
+// vvsfs_next_seq - the sequence number for a block being changed, every block
+//                  written gets a higher one than all blocks before it, so
+//                  send.vvsfs can find the blocks changed since a backup
+static inline unsigned int
+vvsfs_next_seq(struct super_block *sb) {
+  return (unsigned int) atomic_inc_return(&VVSFS_SB(sb)->s_seq);
+}
+
 // vvsfs_writeblock - write a block from the block device(this will just mark the block
-//                      as dirtycopy)
+//                      as dirtycopy). The whole block is replaced, so it is not
+//                      read from the disk first; if it is in the cache anyway
+//                      an unchanged block is not written at all.
 static int
-vvsfs_writeblock(struct super_block *sb, int inum, struct vvsfs_inode *inode) {
+vvsfs_writeblock(struct super_block *sb, unsigned long inum, struct vvsfs_inode *inode) {
   struct buffer_head *bh;
 
-  if (DEBUG) printk("vvsfs - writeblock : %d\n", inum);
+  if (DEBUG_SB(sb)) printk("vvsfs - writeblock : %lu\n", inum);
 
-  bh = sb_bread(sb,inum); //get hold of that buffer
+  bh = sb_getblk(sb,inum); //get hold of that buffer
+  if (!bh) {
+    printk("vvsfs - unable to get block %lu\n", inum);
+    return -EIO;
+  }
 
+  inode->version = VVSFS_FORMAT_VERSION;
+  lock_buffer(bh); // vvsfs_write_inode updates the times in place
+  if (inum == 0)  // a root block read before vvsfs_save_seq must not undo it
+    inode->seq_max = VVSFS_SB(sb)->s_seq_max;
+  // compare everything but the sequence number and the checksum that covers it
+  inode->seq = ((struct vvsfs_inode *) bh->b_data)->seq;
+  inode->csum = ((struct vvsfs_inode *) bh->b_data)->csum;
+  if (buffer_uptodate(bh) && memcmp(bh->b_data, inode, BLOCKSIZE) == 0) {
+    // the block already holds exactly this data (a file rewritten with the
+    // same contents, a directory that did not change), skip the device write
+    unlock_buffer(bh);
+    brelse(bh);
+    vvsfs_trace_block(sb, VVSFS_TRACE_WRITEBLOCK, inum, 1);
+    if (DEBUG_SB(sb)) printk("vvsfs - writeblock unchanged: %lu\n", inum);
+    return BLOCKSIZE;
+  }
+  inode->seq = vvsfs_next_seq(sb);
+  inode->csum = vvsfs_csum(inode); // checksums are kept up to date even with nocsum
   memcpy(bh->b_data, inode, BLOCKSIZE);//copy the inode data to the buffer head
-
+  set_buffer_uptodate(bh);  // under the lock, so a concurrent sb_bread does not read over it
   mark_buffer_dirty(bh); // mark that buffer dirty, changed
-  sync_dirty_buffer(bh);  //force to write back to the actual hard disk
+  unlock_buffer(bh);
+
+  vvsfs_trace_block(sb, VVSFS_TRACE_WRITEBLOCK, inum, 0);
+  if (vvsfs_sync_writes(sb))
+    sync_dirty_buffer(bh);  //force to write back to the actual hard disk
+  else
+    vvsfs_schedule_commit(sb, inum);
   brelse(bh);
-  if (DEBUG) printk("vvsfs - writeblock done: %d\n", inum);
+  if (DEBUG_SB(sb)) printk("vvsfs - writeblock done: %lu\n", inum);
   return BLOCKSIZE;
 }
 
+// vvsfs_free_block - mark an inode block as empty so it can be allocated again
+static void
+vvsfs_free_block(struct super_block *sb, unsigned long inum) {
+  struct vvsfs_inode block;
+
+  if (DEBUG_SB(sb)) printk("vvsfs - free block : %lu\n", inum);
+  memset(&block, 0, sizeof(block));
+  block.is_empty = true;
+  if (vvsfs_writeblock(sb, inum, &block) >= 0)
+    atomic_inc(&VVSFS_SB(sb)->s_free_blocks);
+
+  if (VVSFS_SB(sb)->s_mount_opt & VVSFS_MOUNT_DISCARD) {
+    // the block is still written first, without a journal a crash must not
+    // bring back the old contents; the discard gives the space back later
+    set_bit(inum, VVSFS_SB(sb)->s_discard_pending);
+    queue_delayed_work(system_long_wq, &VVSFS_SB(sb)->s_discard_work, HZ);
+  }
+}
+
+// vvsfs_can_discard - a discarded block has to read back as zeros (which
+//                     readblock takes as an empty block), devices that do not
+//                     promise that are never discarded
+static int
+vvsfs_can_discard(struct super_block *sb) {
+  struct request_queue *q = bdev_get_queue(sb->s_bdev);
+
+  return q && blk_queue_discard(q) && bdev_discard_zeroes_data(sb->s_bdev);
+}
+
+// vvsfs_save_seq - note the last sequence number handed out in block 0 before
+//                  blocks are discarded : a discarded block reads back as
+//                  zeros and takes its number with it, and the mount must not
+//                  start below a number send.vvsfs may already have reported.
+//                  The field is changed in the buffer, like vvsfs_write_inode,
+//                  the directory entries may be changing meanwhile.
+static int
+vvsfs_save_seq(struct super_block *sb) {
+  struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+  struct buffer_head *bh;
+  struct vvsfs_inode *root;
+
+  bh = sb_bread(sb, 0);
+  if (!bh) return -EIO;
+  root = (struct vvsfs_inode *) bh->b_data;
+
+  lock_buffer(bh);
+  if (sbi->s_seq_max == (unsigned int) atomic_read(&sbi->s_seq)) {
+    unlock_buffer(bh);
+    brelse(bh);
+    return 0;
+  }
+  root->seq = vvsfs_next_seq(sb);
+  sbi->s_seq_max = root->seq_max = root->seq;
+  root->csum = vvsfs_csum(root);
+  mark_buffer_dirty(bh);
+  unlock_buffer(bh);
+
+  vvsfs_trace_block(sb, VVSFS_TRACE_WRITEBLOCK, 0, 0);
+  sync_dirty_buffer(bh);  // on the disk before any discard, also when async
+  brelse(bh);
+  return 0;
+}
+
+// vvsfs_discard_free - discard the runs of at least minblocks empty blocks
+//                      between first and last. When only is given, just the
+//                      blocks set in it are considered. Allocation waits until
+//                      this is done. Returns the number of blocks discarded.
+static int
+vvsfs_discard_free(struct super_block *sb, int first, int last, int minblocks,
+                   unsigned long *only) {
+  struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+  struct vvsfs_inode block;
+  int k, start = -1, trimmed = 0, err = 0;
+
+  if (first < 1) first = 1;  // block 0 is the root directory
+  if (last > NUMBLOCKS - 1) last = NUMBLOCKS - 1;
+
+  mutex_lock(&sbi->s_alloc_mutex);
+  if (vvsfs_save_seq(sb) < 0) {
+    mutex_unlock(&sbi->s_alloc_mutex);
+    return -EIO;
+  }
+  // an empty block still dirty in the cache must not be written after its discard
+  if (!vvsfs_sync_writes(sb))
+    vvsfs_flush_dirty(sb);
+
+  for (k = first; k <= last + 1; k++) {
+    if (k <= last && (!only || test_bit(k, only)) &&
+        vvsfs_readblock(sb, k, &block) >= 0 && block.is_empty) {
+      if (start < 0) start = k;
+      continue;
+    }
+    if (start >= 0 && k - start >= minblocks) {
+      if (DEBUG_SB(sb)) printk("vvsfs - discard blocks %d to %d\n", start, k - 1);
+      err = blkdev_issue_discard(sb->s_bdev, (sector_t) start * (BLOCKSIZE >> 9),
+                                 (sector_t) (k - start) * (BLOCKSIZE >> 9), GFP_NOFS, 0);
+      if (err) break;
+      trimmed += k - start;
+    }
+    start = -1;
+  }
+  mutex_unlock(&sbi->s_alloc_mutex);
+  return err ? err : trimmed;
+}
+
+// vvsfs_discard_work - discard the blocks freed since the last run (-o discard)
+static void
+vvsfs_discard_work(struct work_struct *work) {
+  struct vvsfs_sb_info *sbi = container_of(to_delayed_work(work),
+                                           struct vvsfs_sb_info, s_discard_work);
+  unsigned long pending[BITS_TO_LONGS(NUMBLOCKS)];
+  int k;
+
+  memset(pending, 0, sizeof(pending));
+  for (k = 1; k < NUMBLOCKS; k++)
+    if (test_and_clear_bit(k, sbi->s_discard_pending))
+      set_bit(k, pending);
+  vvsfs_discard_free(sbi->s_sb, 1, NUMBLOCKS - 1, 1, pending);
+}
+
+// vvsfs_store_times - copy the timestamps of an inode into its block, so they
+//                     go out with a block write that is being done anyway
+static void
+vvsfs_store_times(struct vvsfs_inode *block, struct inode *inode) {
+  block->atime = inode->i_atime.tv_sec;
+  block->mtime = inode->i_mtime.tv_sec;
+  block->ctime = inode->i_ctime.tv_sec;
+}
+
+// vvsfs_load_times - the other way round, when an inode is read in
+static void
+vvsfs_load_times(struct inode *inode, struct vvsfs_inode *block) {
+  inode->i_atime.tv_sec = block->atime;
+  inode->i_mtime.tv_sec = block->mtime;
+  inode->i_ctime.tv_sec = block->ctime;
+  inode->i_atime.tv_nsec = inode->i_mtime.tv_nsec = inode->i_ctime.tv_nsec = 0;
+}
 
 //vvsfs_mkdir - make a directory - similar to create a file in directory
 static int vvsfs_mkdir(struct inode* dir,struct dentry *dentry,umode_t mode){
       
    struct vvsfs_inode inodedata;
-   struct vvsfs_dir_entry *dent;
    struct vvsfs_inode newinodedata;
 
    struct inode * inode = NULL;
 
-   int num_dirs;
+   int err;
    
-   if (DEBUG) printk("vvsfs - make dir : %s\n",dentry->d_name.name);
+   if (DEBUG_SB(dir->i_sb)) printk("vvsfs - make dir : %s\n",dentry->d_name.name);
+   vvsfs_trace_dentry(VVSFS_TRACE_MKDIR, dentry, 0, 0);
  
    inode_inc_link_count(dir);
   
@@ -159,95 +777,78 @@ static int vvsfs_mkdir(struct inode* dir,struct dentry *dentry,umode_t mode){
    if (!dir) return -1;
    
 
-   vvsfs_readblock(dir->i_sb,dir->i_ino, &inodedata);
-   
-   num_dirs = inodedata.size/sizeof(struct vvsfs_dir_entry);
-
-   dent = (struct vvsfs_dir_entry *) ((inodedata.data) + num_dirs*sizeof(struct vvsfs_dir_entry));
-
-
-   strncpy(dent->name, dentry->d_name.name, dentry->d_name.len);
-   dent->name[dentry->d_name.len] = '\0';
-
-   inodedata.size = (num_dirs + 1)*sizeof(struct vvsfs_dir_entry);
-   
-   dent->inode_number = inode->i_ino;
+   err = -EIO;
+   if (vvsfs_readblock(dir->i_sb,dir->i_ino, &inodedata) < 0 ||
+       (err = vvsfs_add_entry(&inodedata, dentry->d_name.name, dentry->d_name.len, inode->i_ino))) {
+     clear_nlink(inode);  // evict frees the block again
+     iput(inode);
+     inode_dec_link_count(dir);
+     return err;
+   }
 
    vvsfs_readblock(inode->i_sb,inode->i_ino,&newinodedata);
    newinodedata.is_directory = 1;
+   newinodedata.flags = 0;
    vvsfs_writeblock(inode->i_sb, inode->i_ino,&newinodedata);
    
    dir->i_size = inodedata.size;
+   dir->i_ctime = dir->i_mtime = CURRENT_TIME;
+   vvsfs_store_times(&inodedata, dir);
    mark_inode_dirty(dir);
 
    vvsfs_writeblock(dir->i_sb,dir->i_ino,&inodedata);
    d_instantiate(dentry,inode);
 
-   printk("Directory created %ld\n",inode->i_ino);
+   if (DEBUG_SB(dir->i_sb)) printk("Directory created %ld\n",inode->i_ino);
    return 0;
 }
 
 
 
-//vvsfs_empty_dir -to check whether the directory is empty and if it is not emptry, clean the directory
-static int vvsfs_empty_dir(struct inode *dir){
-     
-      struct vvsfs_inode inodedata;   //this is directory data
-      struct vvsfs_dir_entry * dent;
-      struct vvsfs_inode newinodedata;  //this is the each file data in the directory
-      struct inode * inode;
-      
-      int k,num_dirs;
-      vvsfs_readblock(dir->i_sb, dir->i_ino,&inodedata);//get the directory data
-      num_dirs = inodedata.size/sizeof(struct vvsfs_dir_entry);
-
-       for (k=0;k < num_dirs;k++) {
-
-             dent = (struct vvsfs_dir_entry *) ((inodedata.data) + k*sizeof(struct vvsfs_dir_entry));   // get each file directory entry in the directory
-             
-             inode = vvsfs_iget(dir->i_sb, dent->inode_number); // get each file's inode 
-            
-              vvsfs_readblock(inode->i_sb,inode->i_ino,&newinodedata); //get each file data in the directory
+//vvsfs_rmdir  - remove directory from the directory. Only its entry is removed
+//               here : the directory becomes an orphan, and once it is evicted the
+//               reclaim work frees it and everything below it in the background,
+//               so removing a big tree returns quickly.
+static int vvsfs_rmdir(struct inode * dir, struct dentry * dentry){
 
+   struct inode * inode = dentry->d_inode;
+   int err;
 
-              if(newinodedata.is_directory == 1) vvsfs_empty_dir(inode);//check whether it is directory
-              
-              
-              memset(newinodedata.data,0,sizeof(newinodedata.data));
-              newinodedata.size = 0;
-              newinodedata.is_empty = 1;
-              newinodedata.is_directory = 0;
+   err = vvsfs_unlink(dir,dentry);
+   if(!err){
+      inode->i_size = 0;
+      clear_nlink(inode);
+      inode_dec_link_count(dir);
+   }
+   return err;
 
-              vvsfs_writeblock(inode->i_sb,inode->i_ino,&newinodedata);
-}
- 
-      inodedata.is_directory = 0;
-      vvsfs_writeblock(dir->i_sb,dir->i_ino,&inodedata);
-      return 0;
 }
 
 
 
-//vvsfs_rmdir  - remove directory from the directory
-static int vvsfs_rmdir(struct inode * dir, struct dentry * dentry){
-
-   struct inode * inode = dentry->d_inode;
-   
-   int err = -ENOTEMPTY;
-   if( vvsfs_empty_dir(inode) == 0){
-   err = vvsfs_unlink(dir,dentry);
-     if(!err){
-          inode->i_size = 0;
-          inode_dec_link_count(inode);
-          inode_dec_link_count(dir);
-          return 0;}
-    }
-    return err;
-
-}
 
+// vvsfs_readahead_children - start reading the inode blocks of the entries of
+//                            a directory, so the stat of each name that usually
+//                            follows a readdir finds its block in the buffer cache.
+//                            The reads are plugged, the block layer merges them
+//                            into as few requests as it can.
+static void
+vvsfs_readahead_children(struct super_block *sb, struct vvsfs_inode *dirdata)
+{
+	struct vvsfs_dir_entry *dent = (struct vvsfs_dir_entry *) dirdata->data;
+	int k, num_dirs = vvsfs_num_entries(dirdata);
+	struct blk_plug plug;
 
+	num_dirs = min(num_dirs, VVSFS_SB(sb)->s_inode_readahead);
+	if (num_dirs <= 0)
+		return;
 
+	blk_start_plug(&plug);
+	for (k = 0; k < num_dirs; k++, dent++)
+		if (dent->inode_number > 0 && dent->inode_number < NUMBLOCKS)
+			sb_breadahead(sb, dent->inode_number);
+	blk_finish_plug(&plug);
+}
 
 static int
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,10,0)
@@ -263,23 +864,29 @@ vvsfs_readdir(struct file *filp, struct dir_context *ctx)
 	struct vvsfs_dir_entry *dent;
 	int error, k;
 
-	if (DEBUG) printk("vvsfs - readdir\n");
-
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,10,0)
 	i = filp->f_dentry->d_inode;
 #else
 	i = file_inode(filp);
 #endif
-	vvsfs_readblock(i->i_sb, i->i_ino, &dirdata);
-	num_dirs = dirdata.size / sizeof(struct vvsfs_dir_entry);
 
-	if (DEBUG) printk("Number of entries %d fpos %Ld\n", num_dirs, filp->f_pos);
+	if (DEBUG_SB(i->i_sb)) printk("vvsfs - readdir\n");
+	if (filp->f_pos == 0)  // once for each listing, not for every getdents
+		vvsfs_trace_dentry(VVSFS_TRACE_READDIR, filp->f_path.dentry, 0, 0);
+	if (vvsfs_readblock(i->i_sb, i->i_ino, &dirdata) < 0)
+		return -EIO;
+	num_dirs = vvsfs_num_entries(&dirdata);
+
+	if (DEBUG_SB(i->i_sb)) printk("Number of entries %d fpos %Ld\n", num_dirs, filp->f_pos);
+
+	if (filp->f_pos == 0)
+		vvsfs_readahead_children(i->i_sb, &dirdata);
 
 	error = 0;
 	k=0;
 	dent = (struct vvsfs_dir_entry *) &dirdata.data;
 	while (!error && filp->f_pos < dirdata.size && k < num_dirs) {
-		printk("adding name : %s ino : %d\n",dent->name, dent->inode_number);
+		if (DEBUG_SB(i->i_sb)) printk("adding name : %s ino : %u\n",dent->name, dent->inode_number);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,10,0)
 		error = filldir(dirent, 
 		    dent->name, strlen(dent->name), filp->f_pos, dent->inode_number,DT_REG);
@@ -300,7 +907,7 @@ vvsfs_readdir(struct file *filp, struct dir_context *ctx)
         i->i_size = dirdata.size;
         mark_inode_dirty(i);
 	// update_atime(i);
-	printk("done readdir\n");
+	if (DEBUG_SB(i->i_sb)) printk("done readdir\n");
 
 	return 0;
 }
@@ -311,31 +918,24 @@ static struct dentry *
 vvsfs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
 {
 
-  int num_dirs;
   int k;
   struct vvsfs_inode dirdata;
   struct inode *inode = NULL;
   struct vvsfs_dir_entry *dent;
 
-  if (DEBUG) printk("vvsfs - lookup\n");
+  if (DEBUG_SB(dir->i_sb)) printk("vvsfs - lookup\n");
+  vvsfs_trace_dentry(VVSFS_TRACE_LOOKUP, dentry, 0, 0);
 
-  vvsfs_readblock(dir->i_sb,dir->i_ino,&dirdata);
-  num_dirs = dirdata.size/sizeof(struct vvsfs_dir_entry);
+  if (vvsfs_readblock(dir->i_sb,dir->i_ino,&dirdata) < 0)
+    return ERR_PTR(-EIO);
 
-  for (k=0;k < num_dirs;k++) {
-    dent = (struct vvsfs_dir_entry *) ((dirdata.data) + k*sizeof(struct vvsfs_dir_entry));
-    
-    if ((strlen(dent->name) == dentry->d_name.len) && 
-	strncmp(dent->name,dentry->d_name.name,dentry->d_name.len) == 0) {
-      inode = vvsfs_iget(dir->i_sb, dent->inode_number);
+  k = vvsfs_find_entry(&dirdata, dentry->d_name.name, dentry->d_name.len);
+  if (k >= 0) {
+    dent = (struct vvsfs_dir_entry *) dirdata.data + k;
+    inode = vvsfs_iget(dir->i_sb, dent->inode_number);
  
-      if (!inode)
-	return ERR_PTR(-EACCES);
-    
-      d_add(dentry, inode);
-      return NULL;
-
-    }
+    if (IS_ERR(inode))
+      return ERR_PTR(PTR_ERR(inode));
   }
   d_add(dentry, inode);
   return NULL;
@@ -345,30 +945,21 @@ vvsfs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
  int vvsfs_add_link (struct dentry *dentry, struct inode *inode){
  
     struct inode *dir = dentry->d_parent->d_inode;
-    struct vvsfs_dir_entry *dent;
-    int num_dirs;
+    int err;
     
     struct vvsfs_inode inodedata;
     struct vvsfs_inode newinodedata;
-    vvsfs_readblock(dir->i_sb,dir->i_ino,&inodedata);
+    if (vvsfs_readblock(dir->i_sb,dir->i_ino,&inodedata) < 0)
+      return -EIO;
       
-    num_dirs = inodedata.size/sizeof(struct vvsfs_dir_entry);
- 
- 
-    dent = (struct vvsfs_dir_entry *) ((inodedata.data) + num_dirs*sizeof(struct vvsfs_dir_entry));
- 
- 
-    strncpy(dent->name, dentry->d_name.name, dentry->d_name.len);
- 
-    dent->name[dentry->d_name.len] = '\0';
- 
-    dent->inode_number = inode->i_ino;
- 
- 
-    inodedata.size = (num_dirs + 1)*sizeof(struct vvsfs_dir_entry);
+    err = vvsfs_add_entry(&inodedata, dentry->d_name.name, dentry->d_name.len, inode->i_ino);
+    if (err)
+      return err;
     
     
     dir->i_size = inodedata.size;
+    dir->i_ctime = dir->i_mtime = CURRENT_TIME;
+    vvsfs_store_times(&inodedata, dir);
     mark_inode_dirty(dir);
  
     vvsfs_writeblock(dir->i_sb,dir->i_ino,&inodedata);
@@ -389,6 +980,8 @@ vvsfs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
      struct inode *inode = old_dentry->d_inode;
      int err;
  
+     vvsfs_trace_dentry(VVSFS_TRACE_LINK, old_dentry, 0, 0);
+     vvsfs_trace_dentry(VVSFS_TRACE_TO, dentry, 0, 0);
      inode->i_ctime = CURRENT_TIME_SEC;
  
      inode_inc_link_count(inode);
@@ -415,68 +1008,67 @@ vvsfs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
 
 
 
+// vvsfs_release_name - dentry's name is being taken out of its directory block
+//                      (called before the block is written, the name is not counted).
+//                      If that was the last hard link the inode becomes an orphan :
+//                      it is flagged on disk and its block is freed by
+//                      vvsfs_evict_inode once nobody has it open any more (or by
+//                      vvsfs_reclaim_orphans at the next mount after a crash).
+static void vvsfs_release_name(struct dentry *dentry)
+{
+   struct inode *inode = dentry->d_inode;
+   struct super_block *sb = inode->i_sb;
+   struct vvsfs_inode inodedata;
+   int num_hardlinks;
+
+   if (S_ISDIR(inode->i_mode))
+      num_hardlinks = 1;  // directories can not be hard linked
+   else
+      num_hardlinks = vvsfs_find_hard_link(sb->s_root->d_inode,dentry) + 1;
+   if (DEBUG_SB(sb)) printk("hard link is %i\n",num_hardlinks);
+
+   if (num_hardlinks > 1) {
+      // i_nlink is not kept on disk, after a remount it is 1 for every name
+      if (inode->i_nlink > 1)
+         drop_nlink(inode);
+   } else {
+      if (vvsfs_readblock(sb,inode->i_ino,&inodedata) >= 0) {
+         inodedata.flags |= VVSFS_FL_ORPHAN;
+         vvsfs_writeblock(sb,inode->i_ino,&inodedata);
+      }
+      clear_nlink(inode);
+   }
+   mark_inode_dirty(inode);
+}
+
 static int vvsfs_unlink(struct inode *dir, struct dentry *dentry){
         
-   int num_dirs;
-   int num_hardlinks = 0;
-   int k, delindex, del_ino;
+   int delindex;
  
    struct vvsfs_inode inodedata;
-   struct inode *inode = NULL;
-   struct vvsfs_dir_entry *dent;
-
-
-   struct inode *root;
-
-
- if(DEBUG) printk("delete file\n");
-
- vvsfs_readblock(dir->i_sb, dir->i_ino, &inodedata);
- num_dirs = inodedata.size/sizeof(struct vvsfs_dir_entry);
- delindex = -1;
- 
-
- for (k=0;k < num_dirs;k++) {
+   struct inode *inode = dentry->d_inode;
 
-    dent = (struct vvsfs_dir_entry *) ((inodedata.data) + k*sizeof(struct vvsfs_dir_entry));
-    
-         if (delindex == -1 && (strlen(dent->name) == dentry->d_name.len) &&  strncmp(dent->name,dentry->d_name.name,dentry->d_name.len) == 0) {
-               inode = vvsfs_iget(dir->i_sb, dent->inode_number);
-     
-              if (!inode)  return -ENOENT;
-              del_ino = dent->inode_number;
-              delindex = k;
-                   }
-        if (delindex != -1)
-             memcpy(dent,(struct vvsfs_dir_entry *)((inodedata.data)+ (k+1)*sizeof(struct vvsfs_dir_entry)),sizeof(struct vvsfs_dir_entry));
 
-}
+ if(DEBUG_SB(dir->i_sb)) printk("delete file\n");
+ // vvsfs_rmdir comes through here too
+ vvsfs_trace_dentry(S_ISDIR(dentry->d_inode->i_mode) ? VVSFS_TRACE_RMDIR : VVSFS_TRACE_UNLINK,
+                    dentry, 0, 0);
 
+ if (vvsfs_readblock(dir->i_sb, dir->i_ino, &inodedata) < 0)
+   return -EIO;
+ delindex = vvsfs_find_entry(&inodedata, dentry->d_name.name, dentry->d_name.len);
 
     if (delindex != -1){
-      inodedata.size = inodedata.size - sizeof(struct vvsfs_dir_entry);
+      // flag the inode an orphan before the entry goes : after a crash in
+      // between the next mount frees it, the other way round its block is lost
+      inode->i_ctime = CURRENT_TIME;
+      vvsfs_release_name(dentry);
+
+      vvsfs_delete_entry(&inodedata, delindex);
       dir->i_size = inodedata.size;
+      dir->i_ctime = dir->i_mtime = inode->i_ctime;
+      vvsfs_store_times(&inodedata, dir);
       vvsfs_writeblock(dir->i_sb,dir->i_ino,&inodedata);
-
-      vvsfs_readblock(inode->i_sb,del_ino,&inodedata);
-    
-
-      root = vvsfs_iget(dir->i_sb,0);//get the root directory
-      num_hardlinks = vvsfs_find_hard_link(root,dentry) + 1;
-    
-  printk("hard link is %i",num_hardlinks);
-
-      
-     if(num_hardlinks == 1)
-      {memset(inodedata.data,0,sizeof(inodedata.data));
-      inodedata.size = 0;
-      inodedata.is_empty = 1;}
-   
-
-
-      vvsfs_writeblock(dir->i_sb,del_ino, &inodedata);
-
-      inode_dec_link_count(inode);
       mark_inode_dirty(inode);
       
       
@@ -488,15 +1080,126 @@ else {
 }
 
 }
+// vvsfs_rename2 - move a directory entry. Only the one or two directory blocks
+//                 involved are read and written, the file itself is not touched.
+//                 RENAME_EXCHANGE swaps the inodes two names point to.
+static int vvsfs_rename2(struct inode *old_dir, struct dentry *old_dentry,
+                         struct inode *new_dir, struct dentry *new_dentry,
+                         unsigned int flags)
+{
+   struct inode *old_inode = old_dentry->d_inode;
+   struct inode *new_inode = new_dentry->d_inode;
+   struct vvsfs_inode olddirdata, newdirbuf;
+   struct vvsfs_inode *newdirdata = &olddirdata;  // the same block when renaming within a directory
+   struct vvsfs_dir_entry *olddent, *newdent;
+   int oldk, newk, err;
+
+   if (DEBUG_SB(old_dir->i_sb)) printk("vvsfs - rename %s -> %s\n",old_dentry->d_name.name,new_dentry->d_name.name);
+   vvsfs_trace_dentry(VVSFS_TRACE_RENAME, old_dentry, flags, 0);
+   vvsfs_trace_dentry(VVSFS_TRACE_TO, new_dentry, 0, 0);
+
+   if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE))
+      return -EINVAL;
+   if (new_dentry->d_name.len > MAXNAME)
+      return -ENAMETOOLONG;
+   if ((flags & RENAME_NOREPLACE) && new_inode)
+      return -EEXIST;
+   if ((flags & RENAME_EXCHANGE) && !new_inode)
+      return -ENOENT;
+
+   if (vvsfs_readblock(old_dir->i_sb,old_dir->i_ino,&olddirdata) < 0)
+      return -EIO;
+   if (new_dir != old_dir) {
+      if (vvsfs_readblock(new_dir->i_sb,new_dir->i_ino,&newdirbuf) < 0)
+         return -EIO;
+      newdirdata = &newdirbuf;
+   }
+
+   oldk = vvsfs_find_entry(&olddirdata,old_dentry->d_name.name,old_dentry->d_name.len);
+   newk = vvsfs_find_entry(newdirdata,new_dentry->d_name.name,new_dentry->d_name.len);
+   if (oldk < 0 || (new_inode && newk < 0))
+      return -ENOENT;
+   olddent = (struct vvsfs_dir_entry *) olddirdata.data + oldk;
+   newdent = (struct vvsfs_dir_entry *) newdirdata->data + newk;
+
+   if (flags & RENAME_EXCHANGE) {
+      newdent->inode_number = old_inode->i_ino;
+      olddent->inode_number = new_inode->i_ino;
+      if (old_dir != new_dir && S_ISDIR(old_inode->i_mode) != S_ISDIR(new_inode->i_mode)) {
+         if (S_ISDIR(old_inode->i_mode)) {
+            inode_dec_link_count(old_dir);
+            inode_inc_link_count(new_dir);
+         } else {
+            inode_inc_link_count(old_dir);
+            inode_dec_link_count(new_dir);
+         }
+      }
+   } else {
+      if (new_inode) {
+         // the target name is reused for old_inode, a directory must be empty
+         if (S_ISDIR(new_inode->i_mode) && i_size_read(new_inode) != 0)
+            return -ENOTEMPTY;
+         newdent->inode_number = old_inode->i_ino;
+      } else if (new_dir == old_dir) {
+         // a new name in the same directory : change the entry in place
+         memset(olddent->name, 0, sizeof(olddent->name));
+         strncpy(olddent->name,new_dentry->d_name.name,new_dentry->d_name.len);
+      } else {
+         err = vvsfs_add_entry(newdirdata,new_dentry->d_name.name,new_dentry->d_name.len,old_inode->i_ino);
+         if (err)
+            return err;
+      }
+      if (new_inode || new_dir != old_dir)
+         vvsfs_delete_entry(&olddirdata,oldk);
+
+      if (new_inode && S_ISDIR(new_inode->i_mode))
+         inode_dec_link_count(new_dir);  // the directory that was replaced
+      if (S_ISDIR(old_inode->i_mode) && old_dir != new_dir) {
+         inode_dec_link_count(old_dir);
+         inode_inc_link_count(new_dir);
+      }
+   }
+
+   // a replaced inode is flagged an orphan before its name goes, as in vvsfs_unlink
+   if (new_inode && !(flags & RENAME_EXCHANGE))
+      vvsfs_release_name(new_dentry);
+
+   // write the new name first, after a crash the file then has both names rather than none
+   if (new_dir != old_dir) {
+      vvsfs_writeblock(new_dir->i_sb,new_dir->i_ino,newdirdata);
+      new_dir->i_size = newdirdata->size;
+   }
+   vvsfs_writeblock(old_dir->i_sb,old_dir->i_ino,&olddirdata);
+   old_dir->i_size = olddirdata.size;
+
+   old_dir->i_ctime = old_dir->i_mtime = CURRENT_TIME;
+   new_dir->i_ctime = new_dir->i_mtime = CURRENT_TIME;
+   old_inode->i_ctime = CURRENT_TIME;
+   mark_inode_dirty(old_dir);
+   mark_inode_dirty(new_dir);
+   mark_inode_dirty(old_inode);
+
+   if (new_inode) {
+      new_inode->i_ctime = CURRENT_TIME;
+      if (!(flags & RENAME_EXCHANGE) && S_ISDIR(new_inode->i_mode))
+         clear_nlink(new_inode);
+      mark_inode_dirty(new_inode);
+   }
+   return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,15,0)
+// vvsfs_rename - rename without flags for kernels before rename2 was added
+static int vvsfs_rename(struct inode *old_dir, struct dentry *old_dentry,
+                        struct inode *new_dir, struct dentry *new_dentry)
+{
+   return vvsfs_rename2(old_dir,old_dentry,new_dir,new_dentry,0);
+}
+#endif
+
 // vvsfs_empty_inode - finds the first free inode (returns -1 is unable to find one)
 static int vvsfs_empty_inode(struct super_block *sb) {
-  struct vvsfs_inode block;
-  int k;
-  for (k =0;k<NUMBLOCKS;k++) {
-    vvsfs_readblock(sb,k,&block);
-    if (block.is_empty) return k;   
-  }
-  return -1;
+  return vvsfs_find_empty(vvsfs_sb_read, sb);
 }
 
 // vvsfs_new_inode - find and construct a new inode.
@@ -507,7 +1210,7 @@ struct inode * vvsfs_new_inode(const struct inode * dir, umode_t mode)
   struct inode * inode;
   int newinodenumber;
 
-  if (DEBUG) printk("vvsfs - new inode\n");
+  if (DEBUG_SB(dir->i_sb)) printk("vvsfs - new inode\n");
   
   if (!dir) return NULL;
   sb = dir->i_sb;
@@ -516,22 +1219,31 @@ struct inode * vvsfs_new_inode(const struct inode * dir, umode_t mode)
   inode = new_inode(sb);
   if (!inode) return NULL;
  
-  /* find a spare inode in the vvsfs */
+  /* find a spare inode in the vvsfs, FITRIM must not discard it meanwhile */
+  mutex_lock(&VVSFS_SB(sb)->s_alloc_mutex);
   newinodenumber = vvsfs_empty_inode(sb);
   if (newinodenumber == -1) {
+    mutex_unlock(&VVSFS_SB(sb)->s_alloc_mutex);
     printk("vvsfs - inode table is full.\n");
+    iput(inode);
     return NULL;
   }
   
+  memset(&block, 0, sizeof(block));
   block.is_empty = false;
   block.size = 0;
   block.is_directory = false;
+  if (VVSFS_SB(sb)->s_mount_opt & VVSFS_MOUNT_COMPRESS)
+    block.flags = VVSFS_FL_COMPRESS;
+  inode->i_ctime = inode->i_mtime = inode->i_atime = CURRENT_TIME;
+  vvsfs_store_times(&block, inode);
   
   vvsfs_writeblock(sb,newinodenumber,&block);
+  mutex_unlock(&VVSFS_SB(sb)->s_alloc_mutex);
+  atomic_dec(&VVSFS_SB(sb)->s_free_blocks);
   
   inode_init_owner(inode, dir, mode);
   inode->i_ino = newinodenumber;
-  inode->i_ctime = inode->i_mtime = inode->i_atime = CURRENT_TIME;
    
   inode->i_op = NULL;
   
@@ -541,69 +1253,121 @@ struct inode * vvsfs_new_inode(const struct inode * dir, umode_t mode)
 }
 
 //vvsfs_truncate  - truncate the file
-void vvsfs_truncate(struct inode * inode, loff_t size)
+int vvsfs_truncate(struct inode * inode, loff_t size)
 {
 
         struct vvsfs_inode inodedata;
+        int err;
       
 
 	if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) || S_ISLNK(inode->i_mode)))
-		return;
+		return 0;
 
 
-        vvsfs_readblock(inode->i_sb,inode->i_ino,&inodedata);
+        if (vvsfs_readblock(inode->i_sb,inode->i_ino,&inodedata) < 0)
+          return -EIO;
 
-        //inodedata.data[size] = '\0';
-       
-      
-        memset(&inodedata.data[size],0,inodedata.size - size);
-  
-        inodedata.size = (int )size;
+        err = vvsfs_resize_data(&inodedata, size);
+        if (err) return err;
 
       vvsfs_writeblock(inode->i_sb,inode->i_ino,&inodedata);
-       
+      return 0;
          
 } 
 
+// vvsfs_zero_range - overwrite bytes start to end (within the file) of a file's
+//                    block with zeros and write it back
+static int vvsfs_zero_range(struct inode *inode, struct vvsfs_inode *filedata,
+                            loff_t start, loff_t end)
+{
+        char *plain;
+        int err;
+
+        if (start >= end)
+          return 0;
+
+        if (!(filedata->flags & VVSFS_FL_COMPRESSED)) {
+          memset(filedata->data + start, 0, end - start);
+        } else {
+          // zeros compress well, the file may even fit uncompressed afterwards
+          plain = kmalloc(MAXCOMPRESSEDSIZE, GFP_NOFS);
+          if (!plain) return -ENOMEM;
+          err = vvsfs_load_data(filedata, plain);
+          if (!err) {
+            memset(plain + start, 0, end - start);
+            err = vvsfs_store_data(filedata, plain, filedata->size);
+          }
+          kfree(plain);
+          if (err) return err;
+        }
 
-//vvsfs_find_hard_link - because everytime the filesystem is umounted, the cache version about hard link of the file inode will be lost, so this function can promise that the number of hard link of file inode is consistent between each mount.
+        if (vvsfs_writeblock(inode->i_sb,inode->i_ino,filedata) < 0)
+          return -EIO;
+        return 0;
+}
 
-int vvsfs_find_hard_link(struct inode *dir, struct dentry *dentry)
-{   
-   struct inode *inode;
+// vvsfs_fallocate - a file's block is allocated together with its inode, so
+//                   there is never space to reserve : the default mode only
+//                   checks that the range fits and extends the file with zeros,
+//                   FALLOC_FL_PUNCH_HOLE and FALLOC_FL_ZERO_RANGE zero a range.
+//                   With FALLOC_FL_KEEP_SIZE (always there with a punch) only
+//                   the part of the range before the end of file is zeroed.
+static long vvsfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+        struct inode *inode = file_inode(file);
+        struct vvsfs_inode filedata;
+        loff_t end = offset + len;
+        int inside = (mode & FALLOC_FL_KEEP_SIZE) &&
+                     (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE));
+        int err = 0;
+
+        if (DEBUG_SB(inode->i_sb)) printk("vvsfs - fallocate mode %x offset %Ld len %Ld\n", mode, offset, len);
+
+        if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+          return -EOPNOTSUPP;
+        if (!S_ISREG(inode->i_mode))
+          return -ENODEV;
+        if (end > MAXCOMPRESSEDSIZE && !inside)
+          return -EFBIG;
+
+        inode_lock(inode);
+        if (vvsfs_readblock(inode->i_sb,inode->i_ino,&filedata) < 0) {
+          err = -EIO;
+          goto out;
+        }
+        if (inside)  // the range past the end of file is a hole already
+          end = MIN(end, (loff_t) filedata.size);
+        if (end > vvsfs_data_room(&filedata) && !(filedata.flags & VVSFS_FL_COMPRESS)) {
+          err = -ENOSPC;
+          goto out;
+        }
+
+        if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+          err = vvsfs_zero_range(inode, &filedata, offset, MIN(end, (loff_t) filedata.size));
+
+        if (!err && !(mode & FALLOC_FL_KEEP_SIZE) && end > inode->i_size) {
+          err = vvsfs_truncate(inode, end);
+          if (!err)
+            i_size_write(inode, end);
+        }
+
+        if (!err && mode) {
+          inode->i_mtime = inode->i_ctime = CURRENT_TIME;
+          mark_inode_dirty(inode);
+        }
+out:
+        inode_unlock(inode);
+        return err;
+}
 
-   struct vvsfs_inode dirdata;
-   struct vvsfs_inode inodedata;
-
-   struct vvsfs_dir_entry *dent;
-
-   int nlink = 0;
-   int k,num_dirs;
-
-
-      vvsfs_readblock(dir->i_sb,dir->i_ino,&dirdata);
-      num_dirs = dirdata.size/sizeof(struct vvsfs_dir_entry);
-      
-       for (k=0;k < num_dirs;k++) {
-
-          dent = (struct vvsfs_dir_entry *) ((dirdata.data) + k*sizeof(struct vvsfs_dir_entry));
-          inode = vvsfs_iget(dir->i_sb, dent->inode_number);
-
-          vvsfs_readblock(inode->i_sb,inode->i_ino,&inodedata); 
-           
-          if(inodedata.is_directory == 1){ nlink += vvsfs_find_hard_link(inode,dentry);}
-     
-          else{
-                if(dent->inode_number == dentry->d_inode->i_ino && ( strncmp(dent->name,dentry->d_name.name,dentry->d_name.len) != 0 || dir->i_ino != dentry->d_parent->d_inode->i_ino) ) nlink ++;}
-//this "if" is checking whether exists any other file has the same inode number, if there exists, add the number of hard link; 
-
-          }
-
-   
-       
-      return nlink;
 
+//vvsfs_find_hard_link - because everytime the filesystem is umounted, the cache version about hard link of the file inode will be lost, so this function can promise that the number of hard link of file inode is consistent between each mount.
 
+int vvsfs_find_hard_link(struct inode *dir, struct dentry *dentry)
+{
+   return vvsfs_count_names(vvsfs_sb_read, dir->i_sb, dir->i_ino, dentry->d_inode->i_ino,
+                            dentry->d_parent->d_inode->i_ino, dentry->d_name.name,
+                            dentry->d_name.len);
 }
 
 
@@ -614,7 +1378,9 @@ int vvsfs_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *sta
 {
 	struct super_block *sb = dentry->d_sb;
       //  struct inode *dir = dentry->d_parent->d_inode;
-        struct inode *root = vvsfs_iget(sb,0);//get the root directory
+        struct inode *root = sb->s_root->d_inode;//get the root directory
+
+	vvsfs_trace_dentry(VVSFS_TRACE_GETATTR, dentry, 0, 0);
 	generic_fillattr(dentry->d_inode, stat);
 	//stat->blocks = (BLOCK_SIZE / 512) * V1_minix_blocks(stat->size, sb);
 
@@ -635,6 +1401,8 @@ static int vvsfs_setattr(struct dentry *dentry, struct iattr *attr){
    struct inode *inode = dentry->d_inode;
    int error;
 
+   vvsfs_trace_dentry(VVSFS_TRACE_SETATTR, dentry,
+                      (attr->ia_valid & ATTR_SIZE) ? attr->ia_size : -1, 0);
    error = inode_change_ok(inode, attr);
 
    if(error) return error;
@@ -645,8 +1413,10 @@ static int vvsfs_setattr(struct dentry *dentry, struct iattr *attr){
 		if (error)
 			return error;
 
+		error = vvsfs_truncate(inode,attr->ia_size);
+		if (error)
+			return error;
 		truncate_setsize(inode, attr->ia_size);
-		vvsfs_truncate(inode,attr->ia_size);
 	}
 
 	setattr_copy(inode, attr);
@@ -660,12 +1430,12 @@ static int
 vvsfs_create(struct inode *dir, struct dentry* dentry, umode_t mode, bool excl)
 {
   struct vvsfs_inode dirdata;
-  int num_dirs;
-  struct vvsfs_dir_entry *dent;
+  int err;
 
   struct inode * inode;
 
-  if (DEBUG) printk("vvsfs - create : %s\n",dentry->d_name.name);
+  if (DEBUG_SB(dir->i_sb)) printk("vvsfs - create : %s\n",dentry->d_name.name);
+  vvsfs_trace_dentry(VVSFS_TRACE_CREATE, dentry, 0, 0);
 
   inode = vvsfs_new_inode(dir, S_IRUGO|S_IWUGO|S_IFREG);
 
@@ -678,30 +1448,183 @@ vvsfs_create(struct inode *dir, struct dentry* dentry, umode_t mode, bool excl)
   /* get an vfs inode */
   if (!dir) return -1;
 
-  vvsfs_readblock(dir->i_sb,dir->i_ino,&dirdata);
-  num_dirs = dirdata.size/sizeof(struct vvsfs_dir_entry);
-  dent = (struct vvsfs_dir_entry *) ((dirdata.data) + num_dirs*sizeof(struct vvsfs_dir_entry));
+  err = -EIO;
+  if (vvsfs_readblock(dir->i_sb,dir->i_ino,&dirdata) < 0 ||
+      (err = vvsfs_add_entry(&dirdata, dentry->d_name.name, dentry->d_name.len, inode->i_ino))) {
+    clear_nlink(inode);  // evict frees the block again
+    iput(inode);
+    return err;
+  }
 
-  strncpy(dent->name, dentry->d_name.name,dentry->d_name.len);
-  dent->name[dentry->d_name.len] = '\0';
+  dir->i_size = dirdata.size;
+  dir->i_ctime = dir->i_mtime = CURRENT_TIME;
+  vvsfs_store_times(&dirdata, dir);
+  mark_inode_dirty(dir);
   
+  vvsfs_writeblock(dir->i_sb,dir->i_ino,&dirdata);
 
-  dirdata.size = (num_dirs + 1) * sizeof(struct vvsfs_dir_entry);
- 
+  d_instantiate(dentry, inode);
 
-  dent->inode_number = inode->i_ino;
-  
   
+  if (DEBUG_SB(dir->i_sb)) printk("File created %ld\n",inode->i_ino);
+  return 0;
+}
+
+// vvsfs_load_symlink - the target of a symbolic link as a string, for i_private
+static char *
+vvsfs_load_symlink(struct vvsfs_inode *linkdata)
+{
+  char *target, *plain;
+
+  if (!(linkdata->flags & VVSFS_FL_COMPRESSED))
+    return kstrndup(linkdata->data, linkdata->size, GFP_NOFS);
+
+  plain = kmalloc(MAXCOMPRESSEDSIZE, GFP_NOFS);
+  if (!plain) return NULL;
+  target = vvsfs_load_data(linkdata, plain) ? NULL : kstrndup(plain, linkdata->size, GFP_NOFS);
+  kfree(plain);
+  return target;
+}
+
+// vvsfs_symlink - create a symbolic link. The target is stored in the data of
+//                 the inode block like the contents of a file (compressed if it
+//                 is too long to fit), and kept in i_private while the inode is
+//                 in memory, so following the link does not read any block.
+static int
+vvsfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
+{
+  struct vvsfs_inode dirdata, linkdata;
+  struct inode *inode;
+  int len = strlen(symname);
+  int err;
+
+  if (DEBUG_SB(dir->i_sb)) printk("vvsfs - symlink : %s -> %s\n", dentry->d_name.name, symname);
+  if (vvsfs_tracing(dir->i_sb)) {
+    vvsfs_trace_dentry(VVSFS_TRACE_SYMLINK, dentry, 0, 0);
+    vvsfs_trace(VVSFS_TRACE_TO, 0, 0, 0, symname);
+  }
+
+  if (len >= MAXCOMPRESSEDSIZE)
+    return -ENAMETOOLONG;
+  if (vvsfs_readblock(dir->i_sb,dir->i_ino,&dirdata) < 0)
+    return -EIO;
+
+  inode = vvsfs_new_inode(dir, S_IFLNK|S_IRWXUGO);
+  if (!inode)
+    return -ENOSPC;
+  inode->i_op = &vvsfs_symlink_inode_operations;
+
+  inode->i_private = kstrdup(symname, GFP_NOFS);
+  if (!inode->i_private) {
+    err = -ENOMEM;
+    goto fail;
+  }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+  inode->i_link = inode->i_private;
+#endif
+
+  if (vvsfs_readblock(inode->i_sb,inode->i_ino,&linkdata) < 0) {
+    err = -EIO;
+    goto fail;
+  }
+  linkdata.flags |= VVSFS_FL_SYMLINK | VVSFS_FL_COMPRESS;
+  err = vvsfs_store_data(&linkdata, symname, len);
+  if (err) {
+    if (err == -ENOSPC) err = -ENAMETOOLONG;  // does not compress enough
+    goto fail;
+  }
+  vvsfs_writeblock(inode->i_sb,inode->i_ino,&linkdata);
+  inode->i_size = len;
+
+  err = vvsfs_add_entry(&dirdata, dentry->d_name.name, dentry->d_name.len, inode->i_ino);
+  if (err)
+    goto fail;
   dir->i_size = dirdata.size;
+  dir->i_ctime = dir->i_mtime = CURRENT_TIME;
+  vvsfs_store_times(&dirdata, dir);
   mark_inode_dirty(dir);
-  
   vvsfs_writeblock(dir->i_sb,dir->i_ino,&dirdata);
 
   d_instantiate(dentry, inode);
-
-  
-  printk("File created %ld\n",inode->i_ino);
   return 0;
+
+fail:
+  clear_nlink(inode);  // evict frees the block and the target again
+  iput(inode);
+  return err;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,5,0)
+// vvsfs_follow_link - the target is already in memory (newer kernels use
+//                     simple_get_link on i_link instead)
+static void *
+vvsfs_follow_link(struct dentry *dentry, struct nameidata *nd)
+{
+  nd_set_link(nd, dentry->d_inode->i_private);
+  return NULL;
+}
+#endif
+
+// vvsfs_xattr_spill - move the inline extended attributes of a file to its
+//                     overflow block (allocated if it has none, as setxattr
+//                     does), so the contents get the whole block but the tail.
+//                     The overflow block is written first, then block, which is
+//                     the file's own. Runs under i_mutex.
+static int
+vvsfs_xattr_spill(struct inode *inode, struct vvsfs_inode *block)
+{
+  struct super_block *sb = inode->i_sb;
+  struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+  struct vvsfs_xattr_tail *tail = vvsfs_xattr_tail(block);
+  struct vvsfs_xattr_tail *xtail;
+  struct vvsfs_inode *xblock;
+  int xb = tail->block;
+  int err = 0;
+
+  if (!(block->flags & VVSFS_FL_XATTR) || !tail->len)
+    return 0;
+  xblock = kmalloc(sizeof(struct vvsfs_inode), GFP_NOFS);
+  if (!xblock) return -ENOMEM;
+  if (!xb) {
+    memset(xblock, 0, sizeof(struct vvsfs_inode));
+    xblock->flags = VVSFS_FL_XATTR_BLOCK | VVSFS_FL_XATTR;
+  } else if (vvsfs_readblock(sb, xb, xblock) < 0) {
+    err = -EIO;
+    goto out;
+  }
+  xtail = vvsfs_xattr_tail(xblock);
+  if (xtail->len + tail->len > MAXFILESIZE - sizeof(struct vvsfs_xattr_tail)) {
+    err = -ENOSPC;
+    goto out;
+  }
+  // entries are packed backwards from the tail, the inline ones go in front
+  xtail->len += tail->len;
+  memcpy((char *) xtail - xtail->len, (char *) tail - tail->len, tail->len);
+
+  if (!xb) {
+    // the block is claimed by the write, under the allocation lock
+    mutex_lock(&sbi->s_alloc_mutex);
+    xb = vvsfs_empty_inode(sb);
+    if (xb > 0)
+      vvsfs_writeblock(sb, xb, xblock);
+    mutex_unlock(&sbi->s_alloc_mutex);
+    if (xb <= 0) {
+      err = -ENOSPC;
+      goto out;
+    }
+    atomic_dec(&sbi->s_free_blocks);
+  } else {
+    vvsfs_writeblock(sb, xb, xblock);
+  }
+
+  memset((char *) tail - tail->len, 0, tail->len);
+  tail->len = 0;
+  tail->block = xb;
+  if (vvsfs_writeblock(sb, inode->i_ino, block) < 0)
+    err = -EIO;
+out:
+  kfree(xblock);
+  return err;
 }
 
 // vvsfs_file_write - write to a file
@@ -717,8 +1640,11 @@ vvsfs_file_write(struct file *filp, const char *buf, size_t count, loff_t *ppos)
   ssize_t pos;
   struct super_block * sb;
   char * p;
+  char * plain;
+  int err;
 
-  if (DEBUG) printk("vvsfs - file write - count : %zu ppos %Ld\n",count,*ppos);
+  if (DEBUG_SB(inode->i_sb)) printk("vvsfs - file write - count : %zu ppos %Ld\n",count,*ppos);
+  vvsfs_trace_dentry(VVSFS_TRACE_WRITE, filp->f_path.dentry, *ppos, count);
 
   if (!inode) {
     printk("vvsfs - Problem with file inode\n");
@@ -729,35 +1655,72 @@ vvsfs_file_write(struct file *filp, const char *buf, size_t count, loff_t *ppos)
     printk("vvsfs - not regular file\n");
     return -EINVAL;
   }
-  if (*ppos > inode->i_size || count <= 0) {
-    printk("vvsfs - attempting to write over the end of a file.\n");
+  if (count <= 0)
     return 0;
-  }  
   sb = inode->i_sb;
 
-  vvsfs_readblock(sb,inode->i_ino,&filedata);//copy the block from the hard disk into a cache version. Writing means you have to read the data in first
+  // the block is read, changed and written back whole, so writes, truncate,
+  // fallocate and the xattr handlers must not interleave
+  inode_lock(inode);
+  err = -EIO;
+  if (vvsfs_readblock(sb,inode->i_ino,&filedata) < 0)//copy the block from the hard disk into a cache version. Writing means you have to read the data in first
+    goto out;
 
   if (filp->f_flags & O_APPEND)
     pos = inode->i_size; //start at the end of our file
   else
     pos = *ppos;
-
-  if (pos + count > MAXFILESIZE) return -ENOSPC; //return an error
-
-  filedata.size = pos+count;// modify the filesize in cache version
-  p = filedata.data + pos; 
-  if (copy_from_user(p,buf,count))//copy the data from buffer to the position
-    return -ENOSPC;
-  *ppos = pos; // move the file index to the right spot.
+  err = -ENOSPC;
+  if (pos + count > MAXCOMPRESSEDSIZE) goto out; //return an error
+  if (pos + count > vvsfs_data_room(&filedata) &&
+      (pos + count <= MAXFILESIZE - sizeof(struct vvsfs_xattr_tail) ||
+       (filedata.flags & VVSFS_FL_COMPRESS))) {
+    // the contents grow into the inline extended attributes, move them out
+    err = vvsfs_xattr_spill(inode, &filedata);
+    if (err) goto out;
+    err = -ENOSPC;
+  }
+  if (pos + count > vvsfs_data_room(&filedata) && !(filedata.flags & VVSFS_FL_COMPRESS)) goto out;
+
+  if (pos + count <= vvsfs_data_room(&filedata) && !(filedata.flags & VVSFS_FL_COMPRESSED)) {
+    // the data still fits in the block uncompressed
+    if (pos > filedata.size)  // a write past the end of file leaves zeros behind
+      memset(filedata.data + filedata.size, 0, pos - filedata.size);
+    p = filedata.data + pos; 
+    err = -EFAULT;
+    if (copy_from_user(p,buf,count))//copy the data from buffer to the position
+      goto out;
+    filedata.size = max_t(int, filedata.size, pos+count);// modify the filesize in cache version
+  } else {
+    // work on the uncompressed contents and let vvsfs_store_data compress them
+    err = -ENOMEM;
+    plain = kzalloc(MAXCOMPRESSEDSIZE, GFP_NOFS);
+    if (!plain) goto out;
+    err = vvsfs_load_data(&filedata, plain);
+    if (!err && copy_from_user(plain + pos,buf,count))
+      err = -EFAULT;
+    if (!err)
+      err = vvsfs_store_data(&filedata, plain, max_t(int, filedata.size, pos+count));
+    kfree(plain);
+    if (err) goto out;
+  }
+  *ppos = pos + count; // move the file index to the right spot.
   buf += count;
 
   inode->i_size = filedata.size;  //reset the size in underline version in hard disk
+  inode->i_mtime = inode->i_ctime = CURRENT_TIME;
+  vvsfs_store_times(&filedata, inode);  // no separate inode write needed
 
   vvsfs_writeblock(sb,inode->i_ino,&filedata); //write the block 
+  inode_unlock(inode);
   
-  if (DEBUG) printk("vvsfs - file write done : %zu ppos %Ld\n",count,*ppos);
+  if (DEBUG_SB(inode->i_sb)) printk("vvsfs - file write done : %zu ppos %Ld\n",count,*ppos);
   
   return count;
+
+out:
+  inode_unlock(inode);
+  return err;
 }
 
 // vvsfs_file_read - read data from a file
@@ -771,11 +1734,14 @@ vvsfs_file_read(struct file *filp, char *buf, size_t count, loff_t *ppos)
   struct inode *inode = filp->f_path.dentry->d_inode;
 #endif
   char                    *start;
+  char                    *plain;
   ssize_t                  offset, size;
+  int                      err;
 
   struct super_block * sb;
   
-  if (DEBUG) printk("vvsfs - file read - count : %zu ppos %Ld\n",count,*ppos);
+  if (DEBUG_SB(inode->i_sb)) printk("vvsfs - file read - count : %zu ppos %Ld\n",count,*ppos);
+  vvsfs_trace_dentry(VVSFS_TRACE_READ, filp->f_path.dentry, *ppos, count);
 
   if (!inode) {
     printk("vvsfs - Problem with file inode\n");
@@ -787,29 +1753,45 @@ vvsfs_file_read(struct file *filp, char *buf, size_t count, loff_t *ppos)
     return -EINVAL;
   }
   if (*ppos > inode->i_size || count <= 0) {
-    printk("vvsfs - attempting to write over the end of a file.\n");
+    if (DEBUG_SB(inode->i_sb)) printk("vvsfs - attempting to write over the end of a file.\n");
     return 0;
   }  
   sb = inode->i_sb;
 
-  printk("r : readblock\n");
-  vvsfs_readblock(sb,inode->i_ino,&filedata);
+  if (DEBUG_SB(sb)) printk("r : readblock\n");
+  if (vvsfs_readblock(sb,inode->i_ino,&filedata) < 0)
+    return -EIO;
 
   start = buf;
-   printk("rr\n");
-  size = MIN (inode->i_size - *ppos,count);
+  if (DEBUG_SB(sb)) printk("rr\n");
+  // the size of the block just read (checked by readblock), a write may
+  // have changed i_size since
+  if (*ppos >= filedata.size)
+    return 0;
+  size = MIN (filedata.size - *ppos,count);
 
-  printk("readblock : %zu\n", size);
+  if (DEBUG_SB(sb)) printk("readblock : %zu\n", size);
   offset = *ppos;            
   *ppos += size;
 
-  printk("r copy_to_user\n");
-
-  if (copy_to_user(buf,filedata.data + offset,size)) 
+  if (DEBUG_SB(sb)) printk("r copy_to_user\n");
+
+  if (filedata.flags & VVSFS_FL_COMPRESSED) {
+    plain = kmalloc(MAXCOMPRESSEDSIZE, GFP_NOFS);
+    if (!plain)
+      return -ENOMEM;
+    err = vvsfs_load_data(&filedata, plain);
+    if (!err && copy_to_user(buf,plain + offset,size))
+      err = -EIO;
+    kfree(plain);
+    if (err)
+      return err;
+  } else if (copy_to_user(buf,filedata.data + offset,size)) 
     return -EIO;
   buf += size;
+  file_accessed(filp);
   
-  printk("r return\n");
+  if (DEBUG_SB(sb)) printk("r return\n");
   return size;
 }
 
@@ -819,13 +1801,12 @@ static int vvsfs_proc_show(struct seq_file *m, void *v )
 	int num_inodes = 0;// the number of inodes not empty
         int size = 0;
         int i;
-        struct inode *inode;
         struct vvsfs_inode inodedata;
 
+       if (!sb) return 0; // nothing mounted yet
 
-       for(i = 0;i < 100;i++){ //to check our 100 blocks
-          inode = vvsfs_iget(sb,i);
-          vvsfs_readblock(inode->i_sb, inode->i_ino,&inodedata);
+       for(i = 0;i < NUMBLOCKS;i++){ //to check our 100 blocks
+          if (vvsfs_readblock(sb,i,&inodedata) < 0) continue;
           if(inodedata.is_empty == 0) 
           {
            num_inodes ++;  
@@ -851,9 +1832,565 @@ static int vvsfs_proc_open(struct inode *inode, struct file *file)
      
 }
 
+// vvsfs_lock_two - take the inode locks of two files (or of one), the lower
+//                  inode number first so two clones the other way round can
+//                  not deadlock
+static void
+vvsfs_lock_two(struct inode *a, struct inode *b)
+{
+  if (a == b) {
+    inode_lock(a);
+    return;
+  }
+  if (a->i_ino > b->i_ino)
+    swap(a, b);
+  inode_lock(a);
+  inode_lock_nested(b, I_MUTEX_NONDIR2);  // as lock_two_nondirectories
+}
+
+static void
+vvsfs_unlock_two(struct inode *a, struct inode *b)
+{
+  inode_unlock(a);
+  if (a != b)
+    inode_unlock(b);
+}
+
+// vvsfs_clone_range - make len bytes at dst_off in dst_file a copy of the bytes
+//                     at src_off in src_file (len 0 means to the end of src_file).
+//                     The data of a file lives in its inode block, so cloning the
+//                     whole file is one block read and one block write, and there
+//                     is nothing to share copy-on-write. With copy set, a range
+//                     past the end of src_file is cut short like copy_file_range
+//                     does instead of failing. Returns the bytes cloned.
+static ssize_t
+vvsfs_clone_range(struct file *src_file, loff_t src_off,
+                  struct file *dst_file, loff_t dst_off, u64 len, int copy)
+{
+  struct inode *src = file_inode(src_file);
+  struct inode *dst = file_inode(dst_file);
+  struct vvsfs_inode srcdata, dstdata;
+  char *srcplain = NULL, *dstplain = NULL;
+  loff_t newsize;
+  int err;
+
+  if (DEBUG_SB(src->i_sb)) printk("vvsfs - clone %lu -> %lu\n", src->i_ino, dst->i_ino);
+
+  if (src->i_sb != dst->i_sb)
+    return -EXDEV;
+  if (!S_ISREG(src->i_mode) || !S_ISREG(dst->i_mode))
+    return -EINVAL;
+  if (!(src_file->f_mode & FMODE_READ) || !(dst_file->f_mode & FMODE_WRITE) ||
+      (dst_file->f_flags & O_APPEND))
+    return -EBADF;
+
+  // the source block must not change while it is copied
+  vvsfs_lock_two(src, dst);
+  err = -EIO;
+  if (vvsfs_readblock(src->i_sb, src->i_ino, &srcdata) < 0 ||
+      vvsfs_readblock(dst->i_sb, dst->i_ino, &dstdata) < 0)
+    goto out;
+
+  err = -EINVAL;
+  if (src_off < 0 || dst_off < 0 || dst_off > dstdata.size)
+    goto out;
+  if (copy && src_off >= srcdata.size) {
+    len = 0;  // at the end of the source, nothing to copy
+    err = 0;
+    goto out;
+  }
+  if (src_off > srcdata.size)
+    goto out;
+  if (len == 0 && !copy)
+    len = srcdata.size - src_off;
+  if (len > srcdata.size - src_off) {
+    if (!copy)
+      goto out;
+    len = srcdata.size - src_off;
+  }
+  if (src == dst && src_off < dst_off + len && dst_off < src_off + len)
+    goto out;  // overlapping ranges of the same file
+  // dstplain below is MAXCOMPRESSEDSIZE bytes
+  err = -EFBIG;
+  if (dst_off + len > MAXCOMPRESSEDSIZE || dst_off + len > dst->i_sb->s_maxbytes)
+    goto out;
+  newsize = max_t(loff_t, dstdata.size, dst_off + len);
+
+  if (src_off == 0 && dst_off == 0 && len == srcdata.size && newsize == len &&
+      !((srcdata.flags | dstdata.flags) & VVSFS_FL_XATTR)) {
+    // the whole file: copy the stored (possibly compressed) data as it is.
+    // Only how it is stored comes along, the other flags (an orphan source,
+    // compression turned on for the target) stay the target's own.
+    dstdata.size = srcdata.size;
+    dstdata.flags = (dstdata.flags & ~VVSFS_FL_COMPRESSED) |
+                    (srcdata.flags & VVSFS_FL_COMPRESSED);
+    dstdata.csize = srcdata.csize;
+    memcpy(dstdata.data, srcdata.data, MAXFILESIZE);
+  } else {
+    err = -ENOMEM;
+    srcplain = kmalloc(MAXCOMPRESSEDSIZE, GFP_NOFS);
+    dstplain = kmalloc(MAXCOMPRESSEDSIZE, GFP_NOFS);
+    if (!srcplain || !dstplain)
+      goto out;
+    err = vvsfs_load_data(&srcdata, srcplain);
+    if (!err)
+      err = vvsfs_load_data(&dstdata, dstplain);
+    if (err)
+      goto out;
+    memcpy(dstplain + dst_off, srcplain + src_off, len);
+    err = vvsfs_store_data(&dstdata, dstplain, newsize);
+    if (err)
+      goto out;
+  }
+
+  err = vvsfs_writeblock(dst->i_sb, dst->i_ino, &dstdata);
+  if (err < 0)
+    goto out;
+  i_size_write(dst, newsize);
+  dst->i_mtime = dst->i_ctime = CURRENT_TIME;
+  mark_inode_dirty(dst);
+  err = 0;
+out:
+  vvsfs_unlock_two(src, dst);
+  kfree(dstplain);
+  kfree(srcplain);
+  return err ? err : len;
+}
+
+// vvsfs_ioctl_clone - FICLONE/FICLONERANGE from the file open on srcfd
+static long
+vvsfs_ioctl_clone(struct file *dst_file, unsigned long srcfd,
+                  u64 off, u64 len, u64 destoff)
+{
+  struct fd src = fdget(srcfd);
+  ssize_t ret;
+
+  if (!src.file)
+    return -EBADF;
+  ret = mnt_want_write_file(dst_file);
+  if (!ret) {
+    ret = vvsfs_clone_range(src.file, off, dst_file, destoff, len, 0);
+    mnt_drop_write_file(dst_file);
+  }
+  fdput(src);
+  return ret < 0 ? ret : 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+// newer kernels do FICLONE and copy_file_range in the VFS and call these
+// (clone_file_range became remap_file_range in 4.20)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,20,0)
+static int
+vvsfs_clone_file_range(struct file *src_file, loff_t off,
+                       struct file *dst_file, loff_t destoff, u64 len)
+{
+  ssize_t ret = vvsfs_clone_range(src_file, off, dst_file, destoff, len, 0);
+  return ret < 0 ? ret : 0;
+}
+#endif
+
+static ssize_t
+vvsfs_copy_file_range(struct file *src_file, loff_t off,
+                      struct file *dst_file, loff_t destoff,
+                      size_t len, unsigned int flags)
+{
+  if (len == 0)
+    return 0;  // 0 would mean the whole file to vvsfs_clone_range
+  return vvsfs_clone_range(src_file, off, dst_file, destoff, len, 1);
+}
+#endif
+
+// vvsfs_ioctl - FS_IOC_GETFLAGS/FS_IOC_SETFLAGS, so "chattr +c" turns on
+//               compression for a single file, and FICLONE/FICLONERANGE
+static long
+vvsfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+  struct inode *inode = file_inode(filp);
+  struct vvsfs_inode filedata;
+  struct file_clone_range range;
+  unsigned int flags;
+  int err;
+
+  switch (cmd) {
+  case FS_IOC_GETFLAGS:
+    if (vvsfs_readblock(inode->i_sb,inode->i_ino,&filedata) < 0)
+      return -EIO;
+    flags = (filedata.flags & VVSFS_FL_COMPRESS) ? FS_COMPR_FL : 0;
+    return put_user(flags, (int __user *) arg);
+
+  case FS_IOC_SETFLAGS:
+    if (!inode_owner_or_capable(inode))
+      return -EACCES;
+    if (get_user(flags, (int __user *) arg))
+      return -EFAULT;
+    err = mnt_want_write_file(filp);
+    if (err)
+      return err;
+
+    inode_lock(inode);
+    if (vvsfs_readblock(inode->i_sb,inode->i_ino,&filedata) < 0) {
+      err = -EIO;
+    } else {
+      if (flags & FS_COMPR_FL)
+        filedata.flags |= VVSFS_FL_COMPRESS;
+      else
+        filedata.flags &= ~VVSFS_FL_COMPRESS;  // already compressed data stays readable
+      vvsfs_writeblock(inode->i_sb,inode->i_ino,&filedata);
+    }
+    inode_unlock(inode);
+
+    mnt_drop_write_file(filp);
+    return err;
+
+  case FICLONE:
+    return vvsfs_ioctl_clone(filp, arg, 0, 0, 0);
+
+  case FICLONERANGE:
+    if (copy_from_user(&range, (void __user *) arg, sizeof(range)))
+      return -EFAULT;
+    return vvsfs_ioctl_clone(filp, range.src_fd, range.src_offset,
+                             range.src_length, range.dest_offset);
+  }
+  return -ENOTTY;
+}
+
+// vvsfs_dir_ioctl - FITRIM, which fstrim issues on the mount point : discard
+//                   the free blocks in the byte range asked for.
+//                   VVSFS_IOC_DEFRAG, from defrag.vvsfs : compact this directory
+static long
+vvsfs_dir_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+  struct super_block *sb = file_inode(filp)->i_sb;
+  struct fstrim_range range;
+  u64 end, minlen;
+  int trimmed, err;
+
+  switch (cmd) {
+  case VVSFS_IOC_DEFRAG:
+    if (!capable(CAP_SYS_ADMIN))
+      return -EPERM;
+    err = mnt_want_write_file(filp);
+    if (err)
+      return err;
+    err = vvsfs_defrag_dir(file_inode(filp));
+    mnt_drop_write_file(filp);
+    return err;
+
+  case FITRIM:
+    if (!capable(CAP_SYS_ADMIN))
+      return -EPERM;
+    if (!vvsfs_can_discard(sb))
+      return -EOPNOTSUPP;
+    if (copy_from_user(&range, (struct fstrim_range __user *) arg, sizeof(range)))
+      return -EFAULT;
+    if (range.start >= (u64) NUMBLOCKS * BLOCKSIZE || range.len < BLOCKSIZE)
+      return -EINVAL;
+
+    end = min_t(u64, range.len, (u64) NUMBLOCKS * BLOCKSIZE - range.start) + range.start;
+    minlen = min_t(u64, range.minlen, (u64) NUMBLOCKS * BLOCKSIZE);
+    trimmed = vvsfs_discard_free(sb, range.start / BLOCKSIZE, (end - 1) / BLOCKSIZE,
+                                 max_t(int, 1, DIV_ROUND_UP(minlen, BLOCKSIZE)), NULL);
+    if (trimmed < 0)
+      return trimmed;
+
+    range.len = (u64) trimmed * BLOCKSIZE;
+    if (copy_to_user((struct fstrim_range __user *) arg, &range, sizeof(range)))
+      return -EFAULT;
+    return 0;
+  }
+  return -ENOTTY;
+}
+
+// vvsfs_xattr_find - the entry called name in the xattr area of a block, NULL
+//                    if there is none
+static struct vvsfs_xattr_entry *
+vvsfs_xattr_find(struct vvsfs_inode *block, const char *name, int name_len)
+{
+  struct vvsfs_xattr_tail *tail = vvsfs_xattr_tail(block);
+  struct vvsfs_xattr_entry *e;
+  char *p = (char *) tail - tail->len;
+
+  if (!(block->flags & VVSFS_FL_XATTR))
+    return NULL;
+  while (p < (char *) tail) {
+    e = (struct vvsfs_xattr_entry *) p;
+    if (e->name_len == name_len && memcmp(e->name, name, name_len) == 0)
+      return e;
+    p += VVSFS_XATTR_ENTRY_LEN(e->name_len, e->value_len);
+  }
+  return NULL;
+}
+
+// vvsfs_xattr_remove - drop an entry, the ones in front of it move up to the tail
+static void
+vvsfs_xattr_remove(struct vvsfs_inode *block, struct vvsfs_xattr_entry *e)
+{
+  struct vvsfs_xattr_tail *tail = vvsfs_xattr_tail(block);
+  char *start = (char *) tail - tail->len;
+  int len = VVSFS_XATTR_ENTRY_LEN(e->name_len, e->value_len);
+
+  memmove(start + len, start, (char *) e - start);
+  memset(start, 0, len);
+  tail->len -= len;
+}
+
+// vvsfs_xattr_add - put an entry in front of the others, -ENOSPC if the block
+//                   does not have room for it next to used bytes of contents
+static int
+vvsfs_xattr_add(struct vvsfs_inode *block, int used, const char *name, int name_len,
+                const void *value, int value_len)
+{
+  struct vvsfs_xattr_tail *tail = vvsfs_xattr_tail(block);
+  struct vvsfs_xattr_entry *e;
+  int len = VVSFS_XATTR_ENTRY_LEN(name_len, value_len);
+  int room = vvsfs_data_room(block) - used;
+
+  if (!(block->flags & VVSFS_FL_XATTR))
+    room -= sizeof(struct vvsfs_xattr_tail);
+  if (len > room)
+    return -ENOSPC;
+  if (!(block->flags & VVSFS_FL_XATTR)) {
+    block->flags |= VVSFS_FL_XATTR;
+    tail->len = tail->block = 0;
+  }
+
+  tail->len += len;
+  e = (struct vvsfs_xattr_entry *) ((char *) tail - tail->len);
+  memset(e, 0, len);
+  e->name_len = name_len;
+  e->value_len = value_len;
+  memcpy(e->name, name, name_len);
+  memcpy(e->name + name_len, value, value_len);
+  return 0;
+}
+
+// vvsfs_free_xattr_block - free the overflow xattr block of an inode that is
+//                          being freed
+static void
+vvsfs_free_xattr_block(struct super_block *sb, struct vvsfs_inode *block)
+{
+  if ((block->flags & VVSFS_FL_XATTR) && vvsfs_xattr_tail(block)->block)
+    vvsfs_free_block(sb, vvsfs_xattr_tail(block)->block);
+}
+
+// both blocks of an inode with extended attributes, too big for the stack
+struct vvsfs_xattr_blocks {
+  struct vvsfs_inode block;
+  struct vvsfs_inode xblock;
+};
+
+// vvsfs_xattr_read - read the inode block of a regular file and its overflow
+//                    block (xb is 0 if it has none)
+static int
+vvsfs_xattr_read(struct inode *inode, struct vvsfs_xattr_blocks *xa, int *xb)
+{
+  if (!S_ISREG(inode->i_mode))
+    return -EOPNOTSUPP;
+  if (vvsfs_readblock(inode->i_sb, inode->i_ino, &xa->block) < 0)
+    return -EIO;
+  *xb = (xa->block.flags & VVSFS_FL_XATTR) ? vvsfs_xattr_tail(&xa->block)->block : 0;
+  if (*xb && vvsfs_readblock(inode->i_sb, *xb, &xa->xblock) < 0)
+    return -EIO;
+  return 0;
+}
+
+// vvsfs_xattr_get - the user.* handler : the inline entries are in the block
+//                   that was read anyway, the overflow block only when needed
+static int
+vvsfs_xattr_get(struct dentry *dentry, const char *name, void *buffer, size_t size,
+                int handler_flags)
+{
+  struct inode *inode = dentry->d_inode;
+  struct vvsfs_inode block;
+  struct vvsfs_xattr_entry *e;
+  int name_len = strlen(name);
+  int xb;
+
+  if (!S_ISREG(inode->i_mode))
+    return -ENODATA;
+  if (vvsfs_readblock(inode->i_sb, inode->i_ino, &block) < 0)
+    return -EIO;
+  e = vvsfs_xattr_find(&block, name, name_len);
+  if (!e && (block.flags & VVSFS_FL_XATTR) && (xb = vvsfs_xattr_tail(&block)->block)) {
+    if (vvsfs_readblock(inode->i_sb, xb, &block) < 0)
+      return -EIO;
+    e = vvsfs_xattr_find(&block, name, name_len);
+  }
+  if (!e)
+    return -ENODATA;
+  if (buffer) {
+    if (size < e->value_len)
+      return -ERANGE;
+    memcpy(buffer, e->name + e->name_len, e->value_len);
+  }
+  return e->value_len;
+}
+
+// vvsfs_xattr_set - the user.* handler, a NULL value removes the attribute.
+//                   A new value goes inline if the block has room beside the
+//                   contents, otherwise to the overflow block, which is
+//                   allocated with the first entry it takes and freed with the
+//                   last one. Runs under i_mutex.
+static int
+vvsfs_xattr_set(struct dentry *dentry, const char *name, const void *value, size_t size,
+                int flags, int handler_flags)
+{
+  struct inode *inode = dentry->d_inode;
+  struct super_block *sb = inode->i_sb;
+  struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+  struct vvsfs_xattr_blocks *xa;
+  struct vvsfs_xattr_entry *e;
+  int name_len = strlen(name);
+  int used, xb, oldxb, err;
+
+  if (name_len == 0 || name_len > 255)
+    return -EINVAL;
+  if (value && VVSFS_XATTR_ENTRY_LEN(name_len, size) >
+               MAXFILESIZE - sizeof(struct vvsfs_xattr_tail))
+    return -ENOSPC;
+
+  xa = kmalloc(sizeof(struct vvsfs_xattr_blocks), GFP_NOFS);
+  if (!xa) return -ENOMEM;
+  err = vvsfs_xattr_read(inode, xa, &xb);
+  if (err) goto out;
+  oldxb = xb;
+
+  e = vvsfs_xattr_find(&xa->block, name, name_len);
+  if (e)
+    vvsfs_xattr_remove(&xa->block, e);
+  else if (xb && (e = vvsfs_xattr_find(&xa->xblock, name, name_len)))
+    vvsfs_xattr_remove(&xa->xblock, e);
+  err = 0;
+  if (!e && (flags & XATTR_REPLACE))
+    err = -ENODATA;
+  else if (e && (flags & XATTR_CREATE))
+    err = -EEXIST;
+  if (err) goto out;
+
+  if (value) {
+    used = (xa->block.flags & VVSFS_FL_COMPRESSED) ? xa->block.csize : xa->block.size;
+    err = vvsfs_xattr_add(&xa->block, used, name, name_len, value, size);
+    if (err == -ENOSPC) {
+      if (!xb) {
+        memset(&xa->xblock, 0, sizeof(struct vvsfs_inode));
+        xa->xblock.flags = VVSFS_FL_XATTR_BLOCK;
+      }
+      err = vvsfs_xattr_add(&xa->xblock, 0, name, name_len, value, size);
+      if (err) goto out;
+      if (!xb) {
+        // the block is claimed by the write, under the allocation lock
+        mutex_lock(&sbi->s_alloc_mutex);
+        xb = vvsfs_empty_inode(sb);
+        if (xb > 0)
+          vvsfs_writeblock(sb, xb, &xa->xblock);
+        mutex_unlock(&sbi->s_alloc_mutex);
+        if (xb <= 0) {
+          err = -ENOSPC;
+          goto out;
+        }
+        atomic_dec(&sbi->s_free_blocks);
+        vvsfs_xattr_tail(&xa->block)->block = xb;
+        xb = 0;  // written already
+      }
+    }
+  }
+
+  if (oldxb && !vvsfs_xattr_tail(&xa->xblock)->len) {
+    vvsfs_xattr_tail(&xa->block)->block = 0;  // the last entry left it
+    xb = 0;
+  }
+  if (xb)
+    vvsfs_writeblock(sb, xb, &xa->xblock);
+  if ((xa->block.flags & VVSFS_FL_XATTR) && !vvsfs_xattr_tail(&xa->block)->len &&
+      !vvsfs_xattr_tail(&xa->block)->block) {
+    memset(vvsfs_xattr_tail(&xa->block), 0, sizeof(struct vvsfs_xattr_tail));
+    xa->block.flags &= ~VVSFS_FL_XATTR;
+  }
+
+  inode->i_ctime = CURRENT_TIME;
+  vvsfs_store_times(&xa->block, inode);
+  if (vvsfs_writeblock(sb, inode->i_ino, &xa->block) < 0) {
+    err = -EIO;
+    goto out;
+  }
+  if (oldxb && !vvsfs_xattr_tail(&xa->block)->block)
+    vvsfs_free_block(sb, oldxb);
+out:
+  kfree(xa);
+  return err;
+}
+
+// vvsfs_xattr_list_block - add the names in the xattr area of a block to the
+//                          list, with their prefix; the length they need
+static int
+vvsfs_xattr_list_block(struct vvsfs_inode *block, char *buffer, size_t size, int len)
+{
+  struct vvsfs_xattr_tail *tail = vvsfs_xattr_tail(block);
+  struct vvsfs_xattr_entry *e;
+  char *p = (char *) tail - tail->len;
+
+  if (!(block->flags & VVSFS_FL_XATTR))
+    return len;
+  while (p < (char *) tail) {
+    e = (struct vvsfs_xattr_entry *) p;
+    if (buffer) {
+      if (len + XATTR_USER_PREFIX_LEN + e->name_len + 1 > size)
+        return -ERANGE;
+      memcpy(buffer + len, XATTR_USER_PREFIX, XATTR_USER_PREFIX_LEN);
+      memcpy(buffer + len + XATTR_USER_PREFIX_LEN, e->name, e->name_len);
+      buffer[len + XATTR_USER_PREFIX_LEN + e->name_len] = '\0';
+    }
+    len += XATTR_USER_PREFIX_LEN + e->name_len + 1;
+    p += VVSFS_XATTR_ENTRY_LEN(e->name_len, e->value_len);
+  }
+  return len;
+}
+
+// vvsfs_listxattr - the names of all extended attributes of a file
+static ssize_t
+vvsfs_listxattr(struct dentry *dentry, char *buffer, size_t size)
+{
+  struct inode *inode = dentry->d_inode;
+  struct vvsfs_xattr_blocks *xa;
+  int xb, len;
+
+  if (!S_ISREG(inode->i_mode))
+    return 0;
+  xa = kmalloc(sizeof(struct vvsfs_xattr_blocks), GFP_NOFS);
+  if (!xa) return -ENOMEM;
+  len = vvsfs_xattr_read(inode, xa, &xb);
+  if (!len)
+    len = vvsfs_xattr_list_block(&xa->block, buffer, size, 0);
+  if (len >= 0 && xb)
+    len = vvsfs_xattr_list_block(&xa->xblock, buffer, size, len);
+  kfree(xa);
+  return len;
+}
+
+static const struct xattr_handler vvsfs_xattr_user_handler = {
+  .prefix = XATTR_USER_PREFIX,
+  .get    = vvsfs_xattr_get,
+  .set    = vvsfs_xattr_set,
+};
+
+static const struct xattr_handler *vvsfs_xattr_handlers[] = {
+  &vvsfs_xattr_user_handler,
+  NULL
+};
+
 static struct file_operations vvsfs_file_operations = {
         read: vvsfs_file_read,        /* read */
         write: vvsfs_file_write,       /* write */
+        llseek: generic_file_llseek,   /* also SEEK_DATA/SEEK_HOLE */
+        unlocked_ioctl: vvsfs_ioctl,   /* chattr +c, cp --reflink */
+        fsync: vvsfs_fsync,
+        fallocate: vvsfs_fallocate,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+        copy_file_range: vvsfs_copy_file_range,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,20,0)
+        clone_file_range: vvsfs_clone_file_range,
+#endif
+#endif
        
 };
 
@@ -861,6 +2398,11 @@ static struct inode_operations vvsfs_file_inode_operations = {
 
         setattr :   vvsfs_setattr,   /*  truncate */
         getattr :   vvsfs_getattr,
+        update_time : vvsfs_update_time,
+        setxattr :  generic_setxattr,        /* user.* xattrs */
+        getxattr :  generic_getxattr,
+        listxattr : vvsfs_listxattr,
+        removexattr : generic_removexattr,
 };                                                                                                                                                            
 
 static struct file_operations vvsfs_dir_operations = {
@@ -870,8 +2412,9 @@ static struct file_operations vvsfs_dir_operations = {
 	.llseek =	generic_file_llseek,
 	.read	=	generic_read_dir,
 	.iterate =	vvsfs_readdir,
-	.fsync	=	generic_file_fsync,
+	.fsync	=	vvsfs_fsync,
 #endif
+	.unlocked_ioctl = vvsfs_dir_ioctl,	/* fstrim */
 };
 
 static struct inode_operations vvsfs_dir_inode_operations = {
@@ -881,6 +2424,24 @@ static struct inode_operations vvsfs_dir_inode_operations = {
    unlink:     vvsfs_unlink,           /* unlink */
    mkdir:      vvsfs_mkdir,            /* make directory */
    rmdir:      vvsfs_rmdir,            /* remove directory */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,15,0)
+   rename:     vvsfs_rename,           /* rename */
+#else
+   rename2:    vvsfs_rename2,          /* rename with RENAME_NOREPLACE/RENAME_EXCHANGE */
+#endif
+   symlink:    vvsfs_symlink,          /* symbolic link */
+   update_time: vvsfs_update_time,
+};
+
+static struct inode_operations vvsfs_symlink_inode_operations = {
+   readlink:   generic_readlink,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,5,0)
+   follow_link: vvsfs_follow_link,
+#else
+   get_link:   simple_get_link,
+#endif
+   getattr:    vvsfs_getattr,
+   update_time: vvsfs_update_time,
 };
 
 static const struct file_operations vvsfs_proc_fops = {
@@ -896,7 +2457,7 @@ struct inode *vvsfs_iget(struct super_block *sb, unsigned long ino)
     struct inode *inode;
     struct vvsfs_inode filedata; 
 
-    if (DEBUG) {
+    if (DEBUG_SB(sb)) {
         printk("vvsfs - iget - ino : %d", (unsigned int) ino);
         printk(" super %p\n", sb);  
     }
@@ -907,19 +2468,33 @@ struct inode *vvsfs_iget(struct super_block *sb, unsigned long ino)
     if(!(inode->i_state & I_NEW))
         return inode;
 
-    vvsfs_readblock(inode->i_sb,inode->i_ino,&filedata);
+    if (vvsfs_readblock(inode->i_sb,inode->i_ino,&filedata) < 0) {
+        iget_failed(inode);
+        return ERR_PTR(-EIO);
+    }
 
 	inode->i_size = filedata.size;
  
 //	inode->i_uid = (kuid_t) 0;
 //	inode->i_gid = (kgid_t) 0;
 
-	inode->i_ctime = inode->i_mtime = inode->i_atime = CURRENT_TIME;
+	vvsfs_load_times(inode, &filedata);
 
     if (filedata.is_directory) {
         inode->i_mode = S_IRUGO|S_IWUGO|S_IFDIR;
         inode->i_op = &vvsfs_dir_inode_operations;
         inode->i_fop = &vvsfs_dir_operations;
+    } else if (filedata.flags & VVSFS_FL_SYMLINK) {
+        inode->i_mode = S_IFLNK|S_IRWXUGO;
+        inode->i_op = &vvsfs_symlink_inode_operations;
+        inode->i_private = vvsfs_load_symlink(&filedata);
+        if (!inode->i_private) {
+            iget_failed(inode);
+            return ERR_PTR(-ENOMEM);
+        }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+        inode->i_link = inode->i_private;
+#endif
     } else {
         inode->i_mode = S_IRUGO|S_IWUGO|S_IFREG;
         inode->i_op = &vvsfs_file_inode_operations;
@@ -930,17 +2505,589 @@ struct inode *vvsfs_iget(struct super_block *sb, unsigned long ino)
     return inode;
 }
 
+// vvsfs_write_inode - write the timestamps of a dirty inode into its block.
+//                     They are changed in the buffer itself (under the buffer
+//                     lock), so a concurrent vvsfs_writeblock of the same block
+//                     can not be undone by this.
+static int vvsfs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+  struct super_block *sb = inode->i_sb;
+  struct buffer_head *bh;
+  struct vvsfs_inode *block;
+  int err = 0;
+
+  if (DEBUG_SB(inode->i_sb)) printk("vvsfs - write inode %lu\n", inode->i_ino);
+  if (!inode->i_nlink) return 0;  // its block is freed when it is evicted
+
+  bh = sb_bread(sb, inode->i_ino);
+  if (!bh) return -EIO;
+  block = (struct vvsfs_inode *) bh->b_data;
+
+  lock_buffer(bh);
+  if (block->is_empty) {
+    unlock_buffer(bh);
+    brelse(bh);
+    return 0;
+  }
+  if (!(VVSFS_SB(sb)->s_mount_opt & VVSFS_MOUNT_NOCSUM) && block->csum != vvsfs_csum(block)) {
+    // do not give a damaged block a good checksum
+    unlock_buffer(bh);
+    brelse(bh);
+    return -EIO;
+  }
+  if (block->atime == inode->i_atime.tv_sec && block->mtime == inode->i_mtime.tv_sec &&
+      block->ctime == inode->i_ctime.tv_sec) {
+    unlock_buffer(bh);
+    brelse(bh);
+    return 0;
+  }
+  vvsfs_store_times(block, inode);
+  block->seq = vvsfs_next_seq(sb);
+  block->csum = vvsfs_csum(block);
+  mark_buffer_dirty(bh);
+  unlock_buffer(bh);
+
+  vvsfs_trace_block(sb, VVSFS_TRACE_WRITEBLOCK, inode->i_ino, 0);
+  if (vvsfs_sync_writes(sb) || (wbc && wbc->sync_mode == WB_SYNC_ALL))
+    err = sync_dirty_buffer(bh);
+  else
+    vvsfs_schedule_commit(sb, inode->i_ino);
+  brelse(bh);
+  return err;
+}
+
+// vvsfs_update_time - the VFS changes a timestamp (atime on a read, mtime on
+//                     a change it makes itself). With lazytime the new time is
+//                     only kept in memory, it is written with the next block
+//                     write of the inode, by vvsfs_write_inode when the inode is
+//                     written back for another reason, or when it is evicted.
+static int vvsfs_update_time(struct inode *inode, struct timespec *time, int flags)
+{
+  if (flags & S_ATIME)
+    inode->i_atime = *time;
+  if (flags & S_MTIME)
+    inode->i_mtime = *time;
+  if (flags & S_CTIME)
+    inode->i_ctime = *time;
+
+  if (!(VVSFS_SB(inode->i_sb)->s_mount_opt & VVSFS_MOUNT_LAZYTIME))
+    mark_inode_dirty_sync(inode);
+  return 0;
+}
+
+// vvsfs_evict_inode - the last reference to an inode is gone, free its block
+//                     if it has no names left. A removed directory may still
+//                     have a whole tree below it, that is left to the reclaim work.
+static void vvsfs_evict_inode(struct inode *inode)
+{
+  struct vvsfs_inode block;
+
+  if (DEBUG_SB(inode->i_sb)) printk("vvsfs - evict inode %lu nlink %u\n", inode->i_ino, inode->i_nlink);
+
+  // times only updated in memory (lazytime) must not be lost
+  if (inode->i_nlink && !is_bad_inode(inode) &&
+      (VVSFS_SB(inode->i_sb)->s_mount_opt & VVSFS_MOUNT_LAZYTIME))
+    vvsfs_write_inode(inode, NULL);
+
+  truncate_inode_pages(&inode->i_data, 0);
+  invalidate_inode_buffers(inode);
+  clear_inode(inode);
+  if (S_ISLNK(inode->i_mode))
+    kfree(inode->i_private);
+
+  if (!inode->i_nlink && !is_bad_inode(inode)) {
+    if (S_ISDIR(inode->i_mode)) {
+      queue_work(system_long_wq, &VVSFS_SB(inode->i_sb)->s_reclaim_work);
+    } else {
+      if (S_ISREG(inode->i_mode) &&
+          vvsfs_readblock(inode->i_sb, inode->i_ino, &block) >= 0)
+        vvsfs_free_xattr_block(inode->i_sb, &block);
+      vvsfs_free_block(inode->i_sb, inode->i_ino);
+    }
+  }
+}
+
+// vvsfs_count_refs - count the directory entries on disk pointing at each
+//                    inode, block is scratch space
+static void vvsfs_count_refs(struct super_block *s, int *refs, struct vvsfs_inode *block)
+{
+  struct vvsfs_dir_entry *dent;
+  int k, j, num_dirs;
+
+  for (k = 0; k < NUMBLOCKS; k++) {
+    if (vvsfs_readblock(s, k, block) < 0) continue;
+    if (block->is_empty || !block->is_directory) continue;
+    num_dirs = vvsfs_num_entries(block);
+    dent = (struct vvsfs_dir_entry *) block->data;
+    for (j = 0; j < num_dirs; j++, dent++)
+      if (dent->inode_number > 0 && dent->inode_number < NUMBLOCKS)
+        refs[dent->inode_number]++;
+  }
+}
+
+// state of one reclaim pass, too big for the kernel stack
+struct vvsfs_reclaim {
+  int refs[NUMBLOCKS];       // directory entries pointing at each inode
+  int stack[NUMBLOCKS];      // unreachable inodes waiting to be freed
+  struct vvsfs_inode block;
+  struct vvsfs_inode child;
+};
+
+// vvsfs_reclaim_orphans - free the orphan inodes nobody has open any more,
+//                         together with everything below an orphan directory.
+//                         The directory entries on disk are counted first and
+//                         an inode is only freed once the entries being dropped
+//                         were the last ones pointing at it, so names of it in
+//                         other directories keep it alive. Each inode goes on
+//                         the stack at most once, so there is no recursion.
+//                         Runs at mount and from the reclaim work.
+static void vvsfs_reclaim_orphans(struct super_block *s)
+{
+  struct vvsfs_reclaim *rc;
+  struct vvsfs_dir_entry *dent;
+  struct inode *inode;
+  int k, ino, child, num_dirs;
+  int depth = 0;
+
+  rc = kzalloc(sizeof(struct vvsfs_reclaim), GFP_NOFS);
+  if (!rc) return;
+
+  vvsfs_count_refs(s, rc->refs, &rc->block);
+
+  for (k = 1; k < NUMBLOCKS; k++) {
+    if (rc->refs[k]) continue;
+    if (vvsfs_readblock(s, k, &rc->block) < 0) continue;
+    if (rc->block.is_empty || !(rc->block.flags & VVSFS_FL_ORPHAN)) continue;
+
+    // still open, its eviction frees it (and queues us again if it is a directory)
+    inode = ilookup(s, k);
+    if (inode) {
+      iput(inode);
+      continue;
+    }
+    rc->stack[depth++] = k;
+  }
+
+  while (depth > 0) {
+    ino = rc->stack[--depth];
+    if (vvsfs_readblock(s, ino, &rc->block) < 0) continue;
+    if (rc->block.is_empty) continue;  // freed by its eviction meanwhile
+
+    if (rc->block.is_directory) {
+      num_dirs = vvsfs_num_entries(&rc->block);
+      dent = (struct vvsfs_dir_entry *) rc->block.data;
+      for (k = 0; k < num_dirs; k++, dent++) {
+        child = dent->inode_number;
+        if (child <= 0 || child >= NUMBLOCKS || --rc->refs[child] > 0) continue;
+
+        inode = ilookup(s, child);
+        if (inode) {
+          // open through a file descriptor or a working directory
+          if (vvsfs_readblock(s, child, &rc->child) >= 0) {
+            rc->child.flags |= VVSFS_FL_ORPHAN;
+            vvsfs_writeblock(s, child, &rc->child);
+          }
+          clear_nlink(inode);
+          iput(inode);
+        } else {
+          rc->stack[depth++] = child;
+        }
+      }
+    }
+
+    if (DEBUG_SB(s)) printk("vvsfs - reclaiming inode %d\n", ino);
+    vvsfs_free_xattr_block(s, &rc->block);
+    vvsfs_free_block(s, ino);
+  }
+
+  kfree(rc);
+}
+
+// vvsfs_reclaim_work - the background half of rmdir
+static void vvsfs_reclaim_work(struct work_struct *work)
+{
+  struct vvsfs_sb_info *sbi = container_of(work, struct vvsfs_sb_info, s_reclaim_work);
+
+  vvsfs_reclaim_orphans(sbi->s_sb);
+}
+
+// state of one defrag pass, too big for the kernel stack
+struct vvsfs_defrag {
+  int refs[NUMBLOCKS];       // directory entries pointing at each inode
+  int from[NUMBLOCKS];       // the inodes moved, and where to
+  int to[NUMBLOCKS];
+  struct vvsfs_inode dir;
+  struct vvsfs_inode block;
+};
+
+// vvsfs_defrag_dir - sort the entries of a directory by name, drop entries that
+//                    point nowhere, and move the inodes they name into the free
+//                    blocks right behind the directory, in that order, so that
+//                    a readdir followed by reading each entry walks the disk
+//                    forwards. Moving an inode changes its number, so only
+//                    inodes nobody knows the number of are moved : not in the
+//                    inode cache (no open file, no dentry) and with this entry
+//                    as their only name. The copy is written before the entry
+//                    and the old block is freed last. Returns how many inodes
+//                    were moved.
+static int vvsfs_defrag_dir(struct inode *dir)
+{
+  struct super_block *sb = dir->i_sb;
+  struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+  struct vvsfs_defrag *df;
+  struct vvsfs_dir_entry *dent, tmp;
+  struct inode *inode;
+  int i, k, num_dirs, child, target, home, want;
+  int moved = 0;
+
+  df = kzalloc(sizeof(struct vvsfs_defrag), GFP_NOFS);
+  if (!df) return -ENOMEM;
+
+  // the directory lock keeps lookups from finding the entries being moved
+  inode_lock(dir);
+  if (!dir->i_nlink) {  // removed, the reclaim work owns its entries
+    inode_unlock(dir);
+    kfree(df);
+    return -ENOENT;
+  }
+  mutex_lock(&sbi->s_alloc_mutex);
+  if (vvsfs_readblock(sb, dir->i_ino, &df->dir) < 0) {
+    moved = -EIO;
+    goto out;
+  }
+
+  // compact and insertion sort in one pass, there are only a few entries
+  num_dirs = vvsfs_num_entries(&df->dir);
+  dent = (struct vvsfs_dir_entry *) df->dir.data;
+  for (k = 0, i = 0; k < num_dirs; k++) {
+    if (dent[k].inode_number == 0 || dent[k].inode_number >= NUMBLOCKS) continue;
+    tmp = dent[k];
+    for (child = i; child > 0 && strcmp(dent[child-1].name, tmp.name) > 0; child--)
+      dent[child] = dent[child-1];
+    dent[child] = tmp;
+    i++;
+  }
+  memset(&dent[i], 0, (num_dirs - i)*sizeof(struct vvsfs_dir_entry));
+  df->dir.size = i*sizeof(struct vvsfs_dir_entry);
+  num_dirs = i;
+
+  vvsfs_count_refs(sb, df->refs, &df->block);
+
+  home = dir->i_ino;
+  want = home + 1;
+  for (k = 0; k < num_dirs; k++) {
+    child = dent[k].inode_number;
+    if (child == want) {
+      want++;
+      continue;
+    }
+
+    // the first free block from want on that is closer to the directory
+    target = NUMBLOCKS;
+    inode = (df->refs[child] == 1) ? ilookup(sb, child) : NULL;
+    if (inode)
+      iput(inode);  // in use, its number has to stay
+    else if (df->refs[child] == 1)
+      for (target = want; target < NUMBLOCKS && target - home < abs(child - home); target++)
+        if (vvsfs_readblock(sb, target, &df->block) >= 0 && df->block.is_empty)
+          break;
+    if (target >= NUMBLOCKS || target - home >= abs(child - home)) {
+      if (child > want) want = child + 1;
+      continue;
+    }
+
+    if (vvsfs_readblock(sb, child, &df->block) < 0) continue;
+    if (vvsfs_writeblock(sb, target, &df->block) < 0) continue;
+    atomic_dec(&sbi->s_free_blocks);
+    if (DEBUG_SB(dir->i_sb)) printk("vvsfs - defrag : inode %d moved to %d\n", child, target);
+    dent[k].inode_number = target;
+    df->from[moved] = child;
+    df->to[moved++] = target;
+    want = target + 1;
+  }
+
+  if (vvsfs_writeblock(sb, dir->i_ino, &df->dir) < 0) {
+    // the entries still point at the old blocks, drop the copies
+    for (k = 0; k < moved; k++)
+      vvsfs_free_block(sb, df->to[k]);
+    moved = -EIO;
+    goto out;
+  }
+  for (k = 0; k < moved; k++)
+    vvsfs_free_block(sb, df->from[k]);
+
+out:
+  mutex_unlock(&sbi->s_alloc_mutex);
+  inode_unlock(dir);
+  kfree(df);
+  return moved;
+}
+
+// vvsfs_readahead_table - start reading every inode block in one plugged batch,
+//                         the orphan scan and the free count at mount read them all
+static void vvsfs_readahead_table(struct super_block *s)
+{
+  struct blk_plug plug;
+  int k;
+
+  blk_start_plug(&plug);
+  for (k = 0; k < NUMBLOCKS; k++)
+    sb_breadahead(s, k);
+  blk_finish_plug(&plug);
+}
+
+// vvsfs_count_free - the number of empty blocks, for statfs, and the highest
+//                    sequence number on disk, which new writes continue from
+static int vvsfs_count_free(struct super_block *s, unsigned int *seq)
+{
+  struct vvsfs_inode block;
+  int k, nfree = 0;
+
+  *seq = 0;
+  for (k = 0; k < NUMBLOCKS; k++) {
+    if (vvsfs_readblock(s, k, &block) < 0) continue;
+    if (block.is_empty) nfree++;
+    if (block.seq > *seq) *seq = block.seq;
+  }
+  return nfree;
+}
+
+enum {
+  Opt_compress, Opt_nocsum, Opt_csum, Opt_commit, Opt_sync, Opt_async,
+  Opt_noatime, Opt_atime, Opt_lazytime, Opt_nolazytime, Opt_debug,
+  Opt_inode_readahead, Opt_discard, Opt_nodiscard, Opt_trace, Opt_notrace,
+  Opt_err
+};
+
+static const match_table_t vvsfs_tokens = {
+  {Opt_compress, "compress=%s"},
+  {Opt_nocsum, "nocsum"},
+  {Opt_csum, "csum"},
+  {Opt_commit, "commit=%u"},
+  {Opt_sync, "sync"},
+  {Opt_async, "async"},
+  {Opt_noatime, "noatime"},
+  {Opt_atime, "atime"},
+  {Opt_lazytime, "lazytime"},
+  {Opt_nolazytime, "nolazytime"},
+  {Opt_debug, "debug=%u"},
+  {Opt_inode_readahead, "inode_readahead=%u"},
+  {Opt_discard, "discard"},
+  {Opt_nodiscard, "nodiscard"},
+  {Opt_trace, "trace"},
+  {Opt_notrace, "notrace"},
+  {Opt_err, NULL}
+};
+
+// vvsfs_parse_options - parse the comma separated mount options, e.g. "compress=lz4".
+//                       Options that are not given keep their value, so this
+//                       also works for remount.
+static int vvsfs_parse_options(char *options, struct vvsfs_sb_info *sbi)
+{
+  substring_t args[MAX_OPT_ARGS];
+  char *p, *name;
+  int token, n;
+
+  if (!options) return 0;
+
+  while ((p = strsep(&options, ",")) != NULL) {
+    if (!*p) continue;
+
+    token = match_token(p, vvsfs_tokens, args);
+    switch (token) {
+    case Opt_compress:
+      name = match_strdup(&args[0]);
+      if (!name) return -ENOMEM;
+      if (strcmp(name, "lz4") == 0) {
+        sbi->s_mount_opt |= VVSFS_MOUNT_COMPRESS;
+      } else if (strcmp(name, "none") == 0) {
+        sbi->s_mount_opt &= ~VVSFS_MOUNT_COMPRESS;
+      } else {
+        printk("vvsfs - unknown compression \"%s\"\n", name);
+        kfree(name);
+        return -EINVAL;
+      }
+      kfree(name);
+      break;
+    case Opt_nocsum:
+      sbi->s_mount_opt |= VVSFS_MOUNT_NOCSUM;
+      break;
+    case Opt_csum:
+      sbi->s_mount_opt &= ~VVSFS_MOUNT_NOCSUM;
+      break;
+    case Opt_commit:
+      // mount(8) keeps sync and async to itself, a commit interval asks for async
+      if (match_int(&args[0], &n) || n < 0 || n > VVSFS_MAX_COMMIT) {
+        printk("vvsfs - commit must be at most %d seconds\n", VVSFS_MAX_COMMIT);
+        return -EINVAL;
+      }
+      if (n == 0) {
+        sbi->s_mount_opt &= ~VVSFS_MOUNT_ASYNC;
+      } else {
+        sbi->s_mount_opt |= VVSFS_MOUNT_ASYNC;
+        sbi->s_commit_interval = n;
+      }
+      break;
+    case Opt_sync:
+      sbi->s_mount_opt &= ~VVSFS_MOUNT_ASYNC;
+      break;
+    case Opt_async:
+      sbi->s_mount_opt |= VVSFS_MOUNT_ASYNC;
+      break;
+    case Opt_noatime:
+      sbi->s_mount_opt |= VVSFS_MOUNT_NOATIME;
+      break;
+    case Opt_atime:
+      sbi->s_mount_opt &= ~VVSFS_MOUNT_NOATIME;
+      break;
+    case Opt_lazytime:
+      sbi->s_mount_opt |= VVSFS_MOUNT_LAZYTIME;
+      break;
+    case Opt_nolazytime:
+      sbi->s_mount_opt &= ~VVSFS_MOUNT_LAZYTIME;
+      break;
+    case Opt_debug:
+      if (match_int(&args[0], &n)) return -EINVAL;
+      sbi->s_debug = n;
+      break;
+    case Opt_inode_readahead:
+      if (match_int(&args[0], &n) || n > NUMBLOCKS) {
+        printk("vvsfs - inode_readahead must be at most %d\n", NUMBLOCKS);
+        return -EINVAL;
+      }
+      sbi->s_inode_readahead = n;
+      break;
+    case Opt_discard:
+      sbi->s_mount_opt |= VVSFS_MOUNT_DISCARD;
+      break;
+    case Opt_nodiscard:
+      sbi->s_mount_opt &= ~VVSFS_MOUNT_DISCARD;
+      break;
+    case Opt_trace:
+      if (vvsfs_trace_alloc()) return -ENOMEM;
+      sbi->s_mount_opt |= VVSFS_MOUNT_TRACE;
+      break;
+    case Opt_notrace:
+      sbi->s_mount_opt &= ~VVSFS_MOUNT_TRACE;
+      break;
+    default:
+      printk("vvsfs - unrecognized mount option \"%s\"\n", p);
+      return -EINVAL;
+    }
+  }
+  return 0;
+}
+
+// vvsfs_show_options - the options in effect, for /proc/mounts. Defaults are left out.
+static int vvsfs_show_options(struct seq_file *seq, struct dentry *root)
+{
+  struct vvsfs_sb_info *sbi = VVSFS_SB(root->d_sb);
+
+  if (sbi->s_mount_opt & VVSFS_MOUNT_COMPRESS)
+    seq_puts(seq, ",compress=lz4");
+  if (sbi->s_mount_opt & VVSFS_MOUNT_NOCSUM)
+    seq_puts(seq, ",nocsum");
+  if (sbi->s_mount_opt & VVSFS_MOUNT_ASYNC)
+    seq_printf(seq, ",async,commit=%d", sbi->s_commit_interval);
+  if (sbi->s_mount_opt & VVSFS_MOUNT_NOATIME)
+    seq_puts(seq, ",noatime");
+  if (sbi->s_mount_opt & VVSFS_MOUNT_LAZYTIME)
+    seq_puts(seq, ",lazytime");
+  if (sbi->s_mount_opt & VVSFS_MOUNT_DISCARD)
+    seq_puts(seq, ",discard");
+  if (sbi->s_mount_opt & VVSFS_MOUNT_TRACE)
+    seq_puts(seq, ",trace");
+  if (sbi->s_debug != vvsfs_debug)
+    seq_printf(seq, ",debug=%d", sbi->s_debug);
+  if (sbi->s_inode_readahead != VVSFS_DEFAULT_READAHEAD)
+    seq_printf(seq, ",inode_readahead=%d", sbi->s_inode_readahead);
+  return 0;
+}
+
+// vvsfs_remount - change the options of a mounted file system. Everything is
+//                 written out first, so switching between sync and async is safe.
+static int vvsfs_remount(struct super_block *s, int *flags, char *data)
+{
+  struct vvsfs_sb_info *sbi = VVSFS_SB(s);
+  unsigned int old_mount_opt = sbi->s_mount_opt;
+  int old_commit_interval = sbi->s_commit_interval;
+  int old_inode_readahead = sbi->s_inode_readahead;
+  int old_debug = sbi->s_debug;
+  int err;
+
+  if (DEBUG_SB(s)) printk("vvsfs - remount\n");
+
+  sync_filesystem(s);
+  err = vvsfs_parse_options(data, sbi);
+  if (err) {
+    sbi->s_mount_opt = old_mount_opt;
+    sbi->s_commit_interval = old_commit_interval;
+    sbi->s_inode_readahead = old_inode_readahead;
+    sbi->s_debug = old_debug;
+    return err;
+  }
+
+  if (sbi->s_mount_opt & VVSFS_MOUNT_NOATIME)
+    s->s_flags |= MS_NOATIME;
+  else
+    s->s_flags &= ~MS_NOATIME;
+  if ((sbi->s_mount_opt & VVSFS_MOUNT_DISCARD) && !vvsfs_can_discard(s)) {
+    printk("vvsfs - the device does not discard to zeros, discard ignored\n");
+    sbi->s_mount_opt &= ~VVSFS_MOUNT_DISCARD;
+  }
+  if (sbi->s_mount_opt & VVSFS_MOUNT_ASYNC) {
+    // pick up a new interval straight away
+    if (sbi->s_commit_interval != old_commit_interval)
+      mod_delayed_work(system_long_wq, &sbi->s_commit_work,
+                       sbi->s_commit_interval * HZ);
+  } else {
+    cancel_delayed_work_sync(&sbi->s_commit_work);
+    vvsfs_flush_dirty(s);
+  }
+  // the orphans a read only mount left, the work runs once s_flags is changed
+  if ((s->s_flags & MS_RDONLY) && !(*flags & MS_RDONLY))
+    queue_work(system_long_wq, &sbi->s_reclaim_work);
+  return 0;
+}
+
 // vvsfs_fill_super - read the super block (this is simple as we do not
 //                    have one in this file system)
 static int vvsfs_fill_super(struct super_block *s, void *data, int silent)
 {
   struct inode *i;
+  struct vvsfs_sb_info *sbi;
+  struct vvsfs_inode rootdata;
+  unsigned int seq;
   int hblock;
+  int err;
 
   if (DEBUG) printk("vvsfs - fill super\n");
 
-  s->s_flags = MS_NOSUID | MS_NOEXEC;
+  sbi = kzalloc(sizeof(struct vvsfs_sb_info), GFP_KERNEL);
+  if (!sbi) return -ENOMEM;
+  s->s_fs_info = sbi;
+  sbi->s_sb = s;
+  sbi->s_commit_interval = VVSFS_DEFAULT_COMMIT;
+  sbi->s_inode_readahead = VVSFS_DEFAULT_READAHEAD;
+  sbi->s_debug = vvsfs_debug;
+  INIT_WORK(&sbi->s_reclaim_work, vvsfs_reclaim_work);
+  INIT_DELAYED_WORK(&sbi->s_commit_work, vvsfs_commit_work);
+  INIT_DELAYED_WORK(&sbi->s_discard_work, vvsfs_discard_work);
+  mutex_init(&sbi->s_alloc_mutex);
+
+  err = vvsfs_parse_options(data, sbi);
+  if (err) {
+    kfree(sbi);
+    s->s_fs_info = NULL;
+    return err;
+  }
+
+  s->s_flags |= MS_NOSUID | MS_NOEXEC;  // keep MS_RDONLY and MS_SYNCHRONOUS from mount(2)
+  if (sbi->s_mount_opt & VVSFS_MOUNT_NOATIME)
+    s->s_flags |= MS_NOATIME;
   s->s_op = &vvsfs_ops;
+  s->s_xattr = vvsfs_xattr_handlers;
+  s->s_maxbytes = MAXCOMPRESSEDSIZE;
 
   i = new_inode(s);
 
@@ -950,18 +3097,48 @@ static int vvsfs_fill_super(struct super_block *s, void *data, int silent)
   i->i_mode = S_IRUGO|S_IWUGO|S_IXUGO|S_IFDIR;
   i->i_op = &vvsfs_dir_inode_operations;
   i->i_fop = &vvsfs_dir_operations; 
-  printk("inode %p\n", i);
+  if (DEBUG_SB(s)) printk("inode %p\n", i);
 
   hblock = bdev_logical_block_size(s->s_bdev);
   if (hblock > BLOCKSIZE) {
      printk("device blocks are too small!!");
+     kfree(sbi);
+     s->s_fs_info = NULL;
      return -1;
   }
 
   set_blocksize(s->s_bdev, BLOCKSIZE);
   s->s_blocksize = BLOCKSIZE;
   s->s_blocksize_bits = BLOCKSIZE_BITS;
+  if (vvsfs_readblock(s, 0, &rootdata) < 0 || rootdata.version != VVSFS_FORMAT_VERSION) {
+     printk("vvsfs - not a version %d file system, recreate it with mkfs.vvsfs\n",
+            VVSFS_FORMAT_VERSION);
+     iput(i);
+     kfree(sbi);
+     s->s_fs_info = NULL;
+     return -EINVAL;
+  }
+  vvsfs_load_times(i, &rootdata);
   s->s_root = d_make_root(i);
+  if (!s->s_root) {
+     kfree(sbi);
+     s->s_fs_info = NULL;
+     return -ENOMEM;
+  }
+
+  if ((sbi->s_mount_opt & VVSFS_MOUNT_DISCARD) && !vvsfs_can_discard(s)) {
+    printk("vvsfs - the device does not discard to zeros, discard ignored\n");
+    sbi->s_mount_opt &= ~VVSFS_MOUNT_DISCARD;
+  }
+  if (sbi->s_inode_readahead)
+    vvsfs_readahead_table(s);
+  // before the first write, the orphan reclaim already stamps sequence numbers
+  atomic_set(&sbi->s_free_blocks, vvsfs_count_free(s, &seq));
+  // blocks discarded since took their numbers with them, block 0 has the highest
+  sbi->s_seq_max = rootdata.seq_max;
+  atomic_set(&sbi->s_seq, max(seq, rootdata.seq_max));
+  if (!(s->s_flags & MS_RDONLY))  // left to the remount read-write
+    vvsfs_reclaim_orphans(s);
   
   sb = s;
 
@@ -971,6 +3148,10 @@ static int vvsfs_fill_super(struct super_block *s, void *data, int silent)
 static struct super_operations vvsfs_ops = {
   statfs: vvsfs_statfs,
   put_super: vvsfs_put_super,
+  write_inode: vvsfs_write_inode,
+  show_options: vvsfs_show_options,
+  remount_fs: vvsfs_remount,
+  evict_inode: vvsfs_evict_inode,
 };
 
 static struct dentry *vvsfs_mount(struct file_system_type *fs_type,
@@ -989,15 +3170,22 @@ static struct file_system_type vvsfs_type = {
 
 static int __init vvsfs_init(void)
 {
-  printk("Registering vvsfs\n");
+  BUILD_BUG_ON(sizeof(struct vvsfs_inode) != BLOCKSIZE);
+  BUILD_BUG_ON(offsetof(struct vvsfs_inode, data) != VVSFS_HEADER_SIZE);
+  if (DEBUG) printk("Registering vvsfs\n");
   proc_create("vvsfsinfo",0,NULL,&vvsfs_proc_fops);
+  vvsfs_debugfs = debugfs_create_dir("vvsfs", NULL);  // NULL without debugfs, then there is no trace file
+  if (!IS_ERR_OR_NULL(vvsfs_debugfs))
+    debugfs_create_file("trace", S_IRUSR | S_IWUSR, vvsfs_debugfs, NULL, &vvsfs_trace_fops);
   return register_filesystem(&vvsfs_type);/* this point to the vvsfs_type, which is above */ 
 }
 
 static void __exit vvsfs_exit(void)
 {
-  printk("Unregistering the vvsfs.\n");
+  if (DEBUG) printk("Unregistering the vvsfs.\n");
   unregister_filesystem(&vvsfs_type);
+  debugfs_remove_recursive(vvsfs_debugfs);
+  vfree(vvsfs_trace_buf);
 }
 
 module_init(vvsfs_init);
@@ -1,25 +1,100 @@
+#ifndef VVSFS_H
+#define VVSFS_H
+
+#include <linux/types.h>  // __u32 and friends, in the kernel and in user space
+
 #define BLOCKSIZE 512
 #define BLOCKSIZE_BITS 8
 #define NUMBLOCKS 100
 #define MAXNAME 15
 
-#define MAXFILESIZE (BLOCKSIZE - 3*sizeof(int))
+// on-disk format version, kept in every block; mkfs.vvsfs writes it and the
+// module refuses to mount a file system whose root block has another one
+#define VVSFS_FORMAT_VERSION 2
+
+#define VVSFS_HEADER_SIZE 52  // the fields in front of data in struct vvsfs_inode
+#define MAXFILESIZE (BLOCKSIZE - VVSFS_HEADER_SIZE)
+
+// largest logical size of a compressed file, its LZ4 data must still fit in MAXFILESIZE
+#define MAXCOMPRESSEDSIZE 4096
 
+#ifndef MIN  // newer kernels have their own
 #define MIN(a,b) (((a)<(b))?(a):(b))
+#endif
 
 
 #define true 1
 #define false 0
 
+// inode flags
+#define VVSFS_FL_COMPRESS   0x1  // data that does not fit in the block may be compressed
+#define VVSFS_FL_COMPRESSED 0x2  // data holds csize bytes of LZ4 compressed data
+#define VVSFS_FL_ORPHAN     0x4  // unlinked while still open, freed when it is closed
+#define VVSFS_FL_SYMLINK    0x8  // a symbolic link, data holds the target
+#define VVSFS_FL_XATTR      0x10 // data ends with extended attributes (struct vvsfs_xattr_tail)
+#define VVSFS_FL_XATTR_BLOCK 0x20 // not an inode : the overflow xattr block of one
 
+// ioctl on a directory : sort and compact its entries and move their inodes
+// next to it, returns how many were moved (see defrag.vvsfs.c)
+#define VVSFS_IOC_DEFRAG _IO('v', 1)
+
+
+// all fields have a fixed width, sizes and block numbers are unsigned, times
+// are 64 bit. The 64 bit fields sit on 8 byte offsets.
 struct vvsfs_inode {
-  int is_empty;
-  int is_directory; // 1 means it is a directory, 0 means it is a normal file
-  int size;  // how big the file is
+  __u8 is_empty;
+  __u8 is_directory; // 1 means it is a directory, 0 means it is a normal file
+  __u16 version;     // VVSFS_FORMAT_VERSION (0 only in a discarded, all zero block)
+  __u32 flags;       // VVSFS_FL_*
+  __u64 size;        // how big the file is (the uncompressed size if compressed)
+  union {
+    __u32 csize;     // how many bytes of data are used when the file is compressed
+    __u32 seq_max;   // block 0 (the root, never compressed or discarded) : the
+                     // highest sequence number handed out before a discard
+  };
+  __u32 csum;        // CRC32C of the whole block, taken with csum set to 0
+  __s64 atime;       // access, modification and change times, in seconds since 1970
+  __s64 mtime;
+  __s64 ctime;
+  __u32 seq;         // change sequence number of the last write to the block
   char data[MAXFILESIZE];
 };  //this inode has the metadata of the file and also the content of the file 
 
 struct vvsfs_dir_entry {
   char name[MAXNAME+1];
-  int inode_number;
+  __u32 inode_number;  // the block number of the inode
+};
+
+// extended attributes (user.*, kept without the prefix) are packed backwards
+// from the end of data[] : the tail last, the entries in front of it. The
+// contents of a file get the rest of data[]. Entries that do not fit go to an
+// overflow block, which has the same layout and no contents.
+struct vvsfs_xattr_tail {
+  __u16 len;    // bytes of entries in front of the tail
+  __u16 block;  // the overflow block, 0 for none
 };
+
+struct vvsfs_xattr_entry {
+  __u8 name_len;
+  __u8 pad;
+  __u16 value_len;
+  char name[];  // name_len bytes of name, then value_len bytes of value
+};
+
+// entries are kept 4 byte aligned
+#define VVSFS_XATTR_ENTRY_LEN(nl, vl) \
+  ((sizeof(struct vvsfs_xattr_entry) + (nl) + (vl) + 3) & ~3)
+
+// send stream (send.vvsfs, receive.vvsfs) : this header, then nblocks times
+// the block number followed by the whole block
+#define VVSFS_SEND_MAGIC "vvsfssnd"
+
+struct vvsfs_send_header {
+  char magic[8];
+  unsigned int from; // blocks changed after this sequence number are in the stream
+  unsigned int to;   // the highest sequence number on the sending file system
+  int nblocks;
+  unsigned char empty[(NUMBLOCKS+7)/8]; // bitmap of the blocks that are free
+};
+
+#endif
@@ -0,0 +1,300 @@
+/*
+ * vvsfs_lib.c - the block level helpers of vvsfs, see vvsfs_lib.h
+ *
+ * GPL
+ *
+ * Nothing here touches the VFS, the buffer cache or a super block : the
+ * helpers change struct vvsfs_inode blocks in memory, and the ones that
+ * search the inode table get a block reader. vvsfs.c includes this file, so
+ * the module stays one object, and the KUnit module (make kunit) links it
+ * with vvsfs_test.c. It builds on 3.13 and on kernels with the LZ4 API of
+ * 4.11 and later.
+ */
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/lz4.h>
+#include <linux/version.h>
+
+#include "vvsfs.h"
+#include "vvsfs_lib.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+// the LZ4 calls were replaced in 4.11, these keep the old ones
+static inline size_t lz4_compressbound(size_t size)
+{
+  return LZ4_COMPRESSBOUND(size);
+}
+
+static inline int lz4_compress(const unsigned char *src, size_t src_len,
+                               unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+  int n = LZ4_compress_default(src, dst, src_len, *dst_len, wrkmem);
+
+  if (n <= 0)
+    return -1;
+  *dst_len = n;
+  return 0;
+}
+
+static inline int lz4_decompress_unknownoutputsize(const unsigned char *src, size_t src_len,
+                                                   unsigned char *dst, size_t *dst_len)
+{
+  int n = LZ4_decompress_safe(src, dst, src_len, *dst_len);
+
+  if (n < 0)
+    return -1;
+  *dst_len = n;
+  return 0;
+}
+#endif
+
+// vvsfs_find_entry - the index of the entry called name in a directory block,
+//                    -1 if there is no such entry
+int vvsfs_find_entry(struct vvsfs_inode *dirdata, const char *name, int len)
+{
+   struct vvsfs_dir_entry *dent = (struct vvsfs_dir_entry *) dirdata->data;
+   int k, num_dirs = vvsfs_num_entries(dirdata);
+
+   for (k=0;k < num_dirs;k++,dent++) {
+      if (strlen(dent->name) == len && strncmp(dent->name,name,len) == 0)
+         return k;
+   }
+   return -1;
+}
+
+// vvsfs_delete_entry - remove entry k from a directory block, the entries
+//                      behind it move up by one position
+void vvsfs_delete_entry(struct vvsfs_inode *dirdata, int k)
+{
+   struct vvsfs_dir_entry *dent = (struct vvsfs_dir_entry *) dirdata->data;
+   int num_dirs = vvsfs_num_entries(dirdata);
+
+   memmove(&dent[k], &dent[k+1], (num_dirs - k - 1)*sizeof(struct vvsfs_dir_entry));
+   memset(&dent[num_dirs-1], 0, sizeof(struct vvsfs_dir_entry));
+   dirdata->size -= sizeof(struct vvsfs_dir_entry);
+}
+
+// vvsfs_add_entry - append an entry to a directory block, -ENOSPC if it is full,
+//                   -ENAMETOOLONG if the name does not fit in an entry
+int vvsfs_add_entry(struct vvsfs_inode *dirdata, const char *name, int len, int ino)
+{
+   struct vvsfs_dir_entry *dent;
+   int num_dirs = vvsfs_num_entries(dirdata);
+
+   if (len > MAXNAME)
+      return -ENAMETOOLONG;
+   if ((num_dirs + 1)*sizeof(struct vvsfs_dir_entry) > MAXFILESIZE)
+      return -ENOSPC;
+   dent = (struct vvsfs_dir_entry *) dirdata->data + num_dirs;
+   memset(dent, 0, sizeof(struct vvsfs_dir_entry));
+   strncpy(dent->name, name, len);
+   dent->inode_number = ino;
+   dirdata->size += sizeof(struct vvsfs_dir_entry);
+   return 0;
+}
+
+// vvsfs_check_xattr - whether the extended attribute area of a block is sane :
+//                     the tail leaves data[] room, points inside the inode table,
+//                     and the entries end exactly at the tail. The readers walk
+//                     the entries by their lengths and copy names and values.
+static int
+vvsfs_check_xattr(struct vvsfs_inode *block) {
+  struct vvsfs_xattr_tail *tail = vvsfs_xattr_tail(block);
+  struct vvsfs_xattr_entry *e;
+  char *p;
+
+  if (!(block->flags & VVSFS_FL_XATTR))
+    return 0;
+  if (tail->len % 4 || tail->len > MAXFILESIZE - sizeof(struct vvsfs_xattr_tail) ||
+      tail->block >= NUMBLOCKS)
+    return -EIO;
+  for (p = (char *) tail - tail->len; p < (char *) tail;
+       p += VVSFS_XATTR_ENTRY_LEN(e->name_len, e->value_len)) {
+    e = (struct vvsfs_xattr_entry *) p;
+    if ((char *) tail - p < sizeof(struct vvsfs_xattr_entry) ||
+        (char *) tail - p < VVSFS_XATTR_ENTRY_LEN(e->name_len, e->value_len))
+      return -EIO;
+  }
+  return 0;
+}
+
+// vvsfs_check_block - whether the sizes in a block fit in it, 0 or -EIO. The
+//                     readers copy size (or csize) bytes out of data[], a
+//                     damaged block with a good checksum, or any block with
+//                     nocsum, must not take them past its end.
+int
+vvsfs_check_block(struct vvsfs_inode *block) {
+  int room;
+
+  if (block->is_empty)
+    return 0;
+  if (vvsfs_check_xattr(block) < 0)
+    return -EIO;
+  room = vvsfs_data_room(block);
+  if (block->is_directory)
+    return block->size <= MAXFILESIZE ? 0 : -EIO;
+  if (block->flags & VVSFS_FL_COMPRESSED)
+    return (block->csize <= room && block->size <= MAXCOMPRESSEDSIZE) ? 0 : -EIO;
+  return block->size <= room ? 0 : -EIO;
+}
+
+// vvsfs_load_data - copy the contents of a file into buf (which must hold
+//                   MAXCOMPRESSEDSIZE bytes), decompressing them if needed
+int
+vvsfs_load_data(struct vvsfs_inode *filedata, char *buf) {
+  size_t len = MAXCOMPRESSEDSIZE;
+
+  if (!(filedata->flags & VVSFS_FL_COMPRESSED)) {
+    memcpy(buf, filedata->data, filedata->size);
+    return 0;
+  }
+
+  if (lz4_decompress_unknownoutputsize(filedata->data, filedata->csize, buf, &len) ||
+      len != filedata->size) {
+    printk("vvsfs - bad compressed data\n");
+    return -EIO;
+  }
+  return 0;
+}
+
+// vvsfs_store_data - make the first size bytes of buf the contents of a file.
+//                    Data that fits in the block is stored as it is, bigger
+//                    data is LZ4 compressed if the file has VVSFS_FL_COMPRESS.
+int
+vvsfs_store_data(struct vvsfs_inode *filedata, const char *buf, int size) {
+  unsigned char *cdata;
+  void *wrkmem;
+  size_t clen;
+  int room = vvsfs_data_room(filedata);
+  int err = 0;
+
+  if (size <= room) {
+    memcpy(filedata->data, buf, size);
+    memset(filedata->data + size, 0, room - size);
+    filedata->flags &= ~VVSFS_FL_COMPRESSED;
+    filedata->csize = 0;
+    filedata->size = size;
+    return 0;
+  }
+  if (!(filedata->flags & VVSFS_FL_COMPRESS) || size > MAXCOMPRESSEDSIZE)
+    return -ENOSPC;
+
+  clen = lz4_compressbound(size);
+  cdata = kmalloc(clen, GFP_NOFS);
+  wrkmem = kmalloc(LZ4_MEM_COMPRESS, GFP_NOFS);
+  if (!cdata || !wrkmem) {
+    err = -ENOMEM;
+    goto out;
+  }
+
+  if (lz4_compress(buf, size, cdata, &clen, wrkmem)) {
+    err = -EIO;
+    goto out;
+  }
+  if (clen > room) {  // does not compress well enough to fit
+    err = -ENOSPC;
+    goto out;
+  }
+  pr_debug("vvsfs - compressed %d bytes to %zu\n", size, clen);
+
+  memcpy(filedata->data, cdata, clen);
+  memset(filedata->data + clen, 0, room - clen);
+  filedata->flags |= VVSFS_FL_COMPRESSED;
+  filedata->csize = clen;
+  filedata->size = size;
+out:
+  kfree(wrkmem);
+  kfree(cdata);
+  return err;
+}
+
+// vvsfs_resize_data - make the contents in a file's block size bytes long,
+//                     cutting them off or adding zeros at the end
+int
+vvsfs_resize_data(struct vvsfs_inode *inodedata, loff_t size)
+{
+  char *plain;
+  int err;
+
+  if (size <= vvsfs_data_room(inodedata) && !(inodedata->flags & VVSFS_FL_COMPRESSED)) {
+    // the bytes between the old and the new end of file become zeros
+    memset(&inodedata->data[MIN(size, inodedata->size)], 0,
+           (size > inodedata->size) ? size - inodedata->size : inodedata->size - size);
+    inodedata->size = size;
+    return 0;
+  }
+
+  // the file is, or is going to be, compressed
+  plain = kzalloc(MAXCOMPRESSEDSIZE, GFP_NOFS);
+  if (!plain) return -ENOMEM;
+  err = vvsfs_load_data(inodedata, plain);
+  if (!err) {
+    if (size < inodedata->size)
+      memset(plain + size, 0, inodedata->size - size);
+    err = vvsfs_store_data(inodedata, plain, size);
+  }
+  kfree(plain);
+  return err;
+}
+
+// vvsfs_find_empty - the first free block that read gives (returns -1 is unable to find one)
+int
+vvsfs_find_empty(vvsfs_read_t read, void *ctx) {
+  struct vvsfs_inode block;
+  int k;
+  for (k =0;k<NUMBLOCKS;k++) {
+    if (read(ctx,k,&block) < 0) continue; // never reuse a damaged block
+    if (block.is_empty) return k;
+  }
+  return -1;
+}
+
+// vvsfs_count_names - the entries for inode ino in directory dir_ino and the
+//                     directories below it, not counting the entry called name
+//                     in name_dir. The blocks are read directly, taking an inode
+//                     reference for every entry would keep unlinked inodes from
+//                     being evicted.
+int vvsfs_count_names(vvsfs_read_t read, void *ctx,
+                      unsigned long dir_ino, unsigned long ino,
+                      unsigned long name_dir, const char *name, int len)
+{
+   struct vvsfs_inode dirdata;
+   struct vvsfs_inode inodedata;
+
+   struct vvsfs_dir_entry *dent;
+
+   int nlink = 0;
+   int k,num_dirs;
+
+
+      if (read(ctx,dir_ino,&dirdata) < 0)
+         return 0;
+      num_dirs = vvsfs_num_entries(&dirdata);
+
+       for (k=0;k < num_dirs;k++) {
+
+          dent = (struct vvsfs_dir_entry *) ((dirdata.data) + k*sizeof(struct vvsfs_dir_entry));
+
+          if (read(ctx,dent->inode_number,&inodedata) < 0)
+             continue;
+
+          if(inodedata.is_directory == 1){ nlink += vvsfs_count_names(read,ctx,dent->inode_number,ino,name_dir,name,len);}
+
+          else{
+                // the whole name, "ab" must not match an entry "abc" (as in vvsfs_find_entry)
+                if(dent->inode_number == ino && (strlen(dent->name) != len || strncmp(dent->name,name,len) != 0 ||
+                                                 dir_ino != name_dir)) nlink ++;}
+//this "if" is checking whether exists any other file has the same inode number, if there exists, add the number of hard link;
+
+          }
+
+
+
+      return nlink;
+
+
+}
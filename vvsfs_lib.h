@@ -0,0 +1,51 @@
+/* vvsfs_lib.h - the block level helpers of vvsfs : directory entries, the
+   contents of a file and searching the inode table. They only work on
+   struct vvsfs_inode blocks and a block reader, never on VFS objects, so the
+   KUnit suite (vvsfs_test.c) builds them on kernels vvsfs.c does not build on.
+   Include vvsfs.h first.
+   GPL */
+
+#ifndef VVSFS_LIB_H
+#define VVSFS_LIB_H
+
+// a block reader : read block inum into block, a negative error if it can
+// not be read. vvsfs.c reads the device, vvsfs_test.c an image in memory.
+typedef int (*vvsfs_read_t)(void *ctx, unsigned long inum, struct vvsfs_inode *block);
+
+// vvsfs_num_entries - the number of entries in a directory block. The size is
+//                     never more than MAXFILESIZE, so divide in 32 bits (a 64
+//                     bit division needs a helper on 32 bit kernels)
+static inline int
+vvsfs_num_entries(struct vvsfs_inode *dirdata) {
+  return (unsigned int) MIN(dirdata->size, MAXFILESIZE) / sizeof(struct vvsfs_dir_entry);
+}
+
+// vvsfs_xattr_tail - the end of the extended attribute area of a block
+static inline struct vvsfs_xattr_tail *
+vvsfs_xattr_tail(struct vvsfs_inode *block) {
+  return (struct vvsfs_xattr_tail *) (block->data + MAXFILESIZE - sizeof(struct vvsfs_xattr_tail));
+}
+
+// vvsfs_data_room - how much of data[] the contents of a file may use, the
+//                   inline extended attributes have the rest (a block from
+//                   vvsfs_readblock has passed vvsfs_check_block, the tail is sane)
+static inline int
+vvsfs_data_room(struct vvsfs_inode *block) {
+  if (!(block->flags & VVSFS_FL_XATTR))
+    return MAXFILESIZE;
+  return MAXFILESIZE - sizeof(struct vvsfs_xattr_tail) - vvsfs_xattr_tail(block)->len;
+}
+
+int vvsfs_find_entry(struct vvsfs_inode *dirdata, const char *name, int len);
+void vvsfs_delete_entry(struct vvsfs_inode *dirdata, int k);
+int vvsfs_add_entry(struct vvsfs_inode *dirdata, const char *name, int len, int ino);
+int vvsfs_check_block(struct vvsfs_inode *block);
+int vvsfs_load_data(struct vvsfs_inode *filedata, char *buf);
+int vvsfs_store_data(struct vvsfs_inode *filedata, const char *buf, int size);
+int vvsfs_resize_data(struct vvsfs_inode *inodedata, loff_t size);
+int vvsfs_find_empty(vvsfs_read_t read, void *ctx);
+int vvsfs_count_names(vvsfs_read_t read, void *ctx,
+                      unsigned long dir_ino, unsigned long ino,
+                      unsigned long name_dir, const char *name, int len);
+
+#endif
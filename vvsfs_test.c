@@ -0,0 +1,392 @@
+/*
+ * vvsfs_test.c - KUnit tests and benchmarks for the block level helpers in
+ *                vvsfs_lib.c : the allocator, directory entry search, insert
+ *                and delete, link counting and resizing the contents of a file.
+ *
+ * make kunit (VVSFS_KUNIT=1) links it with vvsfs_lib.c into vvsfs_kunit.ko,
+ * without vvsfs.c, whose VFS code only builds on the old kernels vvsfs was
+ * written for. The helpers that walk the inode table take a block reader,
+ * here they read an image in memory, so no device or mount is needed. The
+ * suite runs when the module is loaded, e.g. into a UML kernel built with
+ * CONFIG_KUNIT, and reports to the kernel log.
+ *
+ * The benchmarks print the time per operation with kunit_info. A directory
+ * holds at most MAXFILESIZE / sizeof(struct vvsfs_dir_entry) entries and the
+ * table NUMBLOCKS inodes, so they repeat the operations at those sizes
+ * VVSFS_BENCH_LOOPS times.
+ */
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/bitops.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,5,0)
+#error "the vvsfs KUnit suite needs a kernel with KUnit (5.5 or later)"
+#endif
+
+#include <kunit/test.h>
+
+#include "vvsfs.h"
+#include "vvsfs_lib.h"
+
+#define VVSFS_BENCH_LOOPS 10000
+
+// an inode table in memory, as mkfs.vvsfs makes it
+struct vvsfs_test_image {
+  struct vvsfs_inode blocks[NUMBLOCKS];
+  unsigned long damaged[BITS_TO_LONGS(NUMBLOCKS)];  // blocks that fail to read
+  unsigned long reads;
+};
+
+#define VVSFS_MAX_ENTRIES ((int) (MAXFILESIZE / sizeof(struct vvsfs_dir_entry)))
+
+// vvsfs_test_read - the block reader for the image, like vvsfs_readblock
+static int
+vvsfs_test_read(void *ctx, unsigned long inum, struct vvsfs_inode *block) {
+  struct vvsfs_test_image *img = ctx;
+
+  if (inum >= NUMBLOCKS || test_bit(inum, img->damaged))
+    return -EIO;
+  img->reads++;
+  memcpy(block, &img->blocks[inum], BLOCKSIZE);
+  return BLOCKSIZE;
+}
+
+// vvsfs_test_init - a new image for each test, an empty root and free blocks
+static int
+vvsfs_test_init(struct kunit *test) {
+  struct vvsfs_test_image *img;
+  int k;
+
+  img = kunit_kzalloc(test, sizeof(struct vvsfs_test_image), GFP_KERNEL);
+  if (!img) return -ENOMEM;
+  for (k = 1; k < NUMBLOCKS; k++)
+    img->blocks[k].is_empty = 1;
+  img->blocks[0].is_directory = 1;
+  test->priv = img;
+  return 0;
+}
+
+// vvsfs_test_mknod - give name in directory dir the inode in block k
+static void
+vvsfs_test_mknod(struct kunit *test, int dir, const char *name, int k, int is_directory) {
+  struct vvsfs_test_image *img = test->priv;
+
+  img->blocks[k].is_empty = 0;
+  img->blocks[k].is_directory = is_directory;
+  KUNIT_ASSERT_EQ(test, vvsfs_add_entry(&img->blocks[dir], name, strlen(name), k), 0);
+}
+
+static void
+vvsfs_test_find_empty(struct kunit *test) {
+  struct vvsfs_test_image *img = test->priv;
+  int k;
+
+  KUNIT_EXPECT_EQ(test, vvsfs_find_empty(vvsfs_test_read, img), 1);
+  for (k = 1; k < 50; k++)
+    img->blocks[k].is_empty = 0;
+  KUNIT_EXPECT_EQ(test, vvsfs_find_empty(vvsfs_test_read, img), 50);
+  set_bit(50, img->damaged);  // never handed out
+  KUNIT_EXPECT_EQ(test, vvsfs_find_empty(vvsfs_test_read, img), 51);
+  for (k = 51; k < NUMBLOCKS; k++)
+    img->blocks[k].is_empty = 0;
+  KUNIT_EXPECT_EQ(test, vvsfs_find_empty(vvsfs_test_read, img), -1);
+}
+
+static void
+vvsfs_test_add_entry(struct kunit *test) {
+  struct vvsfs_test_image *img = test->priv;
+  struct vvsfs_inode *dir = &img->blocks[0];
+  struct vvsfs_dir_entry *dent = (struct vvsfs_dir_entry *) dir->data;
+  char name[MAXNAME + 2];
+  int k;
+
+  for (k = 0; k < VVSFS_MAX_ENTRIES; k++) {
+    snprintf(name, sizeof(name), "f%d", k);
+    KUNIT_EXPECT_EQ(test, vvsfs_add_entry(dir, name, strlen(name), k + 1), 0);
+  }
+  KUNIT_EXPECT_EQ(test, vvsfs_num_entries(dir), VVSFS_MAX_ENTRIES);
+  KUNIT_EXPECT_EQ(test, dir->size, (__u64) VVSFS_MAX_ENTRIES * sizeof(struct vvsfs_dir_entry));
+  KUNIT_EXPECT_STREQ(test, dent[3].name, "f3");
+  KUNIT_EXPECT_EQ(test, dent[3].inode_number, 4u);
+  KUNIT_EXPECT_EQ(test, vvsfs_add_entry(dir, "full", 4, 1), -ENOSPC);
+  KUNIT_EXPECT_EQ(test, vvsfs_num_entries(dir), VVSFS_MAX_ENTRIES);
+}
+
+static void
+vvsfs_test_add_entry_name(struct kunit *test) {
+  struct vvsfs_test_image *img = test->priv;
+  struct vvsfs_inode *dir = &img->blocks[0];
+  struct vvsfs_dir_entry *dent = (struct vvsfs_dir_entry *) dir->data;
+
+  KUNIT_EXPECT_EQ(test, vvsfs_add_entry(dir, "0123456789abcdef", MAXNAME + 1, 1), -ENAMETOOLONG);
+  KUNIT_EXPECT_EQ(test, vvsfs_num_entries(dir), 0);
+  // the name is not terminated in the dentry, only its length counts
+  KUNIT_EXPECT_EQ(test, vvsfs_add_entry(dir, "0123456789abcdefgh", MAXNAME, 1), 0);
+  KUNIT_EXPECT_STREQ(test, dent[0].name, "0123456789abcde");
+}
+
+static void
+vvsfs_test_find_entry(struct kunit *test) {
+  struct vvsfs_test_image *img = test->priv;
+  struct vvsfs_inode *dir = &img->blocks[0];
+
+  KUNIT_EXPECT_EQ(test, vvsfs_find_entry(dir, "a", 1), -1);
+  vvsfs_test_mknod(test, 0, "a", 1, 0);
+  vvsfs_test_mknod(test, 0, "ab", 2, 0);
+  vvsfs_test_mknod(test, 0, "abc", 3, 0);
+  KUNIT_EXPECT_EQ(test, vvsfs_find_entry(dir, "a", 1), 0);
+  KUNIT_EXPECT_EQ(test, vvsfs_find_entry(dir, "ab", 2), 1);
+  KUNIT_EXPECT_EQ(test, vvsfs_find_entry(dir, "abc", 3), 2);
+  KUNIT_EXPECT_EQ(test, vvsfs_find_entry(dir, "abcd", 4), -1);
+  KUNIT_EXPECT_EQ(test, vvsfs_find_entry(dir, "b", 1), -1);
+  KUNIT_EXPECT_EQ(test, vvsfs_find_entry(dir, "abx", 2), 1);  // a name in the dcache is not terminated
+}
+
+static void
+vvsfs_test_delete_entry(struct kunit *test) {
+  struct vvsfs_test_image *img = test->priv;
+  struct vvsfs_inode *dir = &img->blocks[0];
+  struct vvsfs_dir_entry *dent = (struct vvsfs_dir_entry *) dir->data;
+
+  vvsfs_test_mknod(test, 0, "a", 1, 0);
+  vvsfs_test_mknod(test, 0, "b", 2, 0);
+  vvsfs_test_mknod(test, 0, "c", 3, 0);
+  vvsfs_test_mknod(test, 0, "d", 4, 0);
+  vvsfs_delete_entry(dir, 1);
+  KUNIT_EXPECT_EQ(test, vvsfs_num_entries(dir), 3);
+  KUNIT_EXPECT_STREQ(test, dent[0].name, "a");
+  KUNIT_EXPECT_STREQ(test, dent[1].name, "c");
+  KUNIT_EXPECT_EQ(test, dent[2].inode_number, 4u);
+  KUNIT_EXPECT_PTR_EQ(test, memchr_inv(&dent[3], 0, sizeof(struct vvsfs_dir_entry)), NULL);
+  KUNIT_EXPECT_EQ(test, vvsfs_find_entry(dir, "b", 1), -1);
+  KUNIT_EXPECT_EQ(test, vvsfs_find_entry(dir, "d", 1), 2);
+  vvsfs_delete_entry(dir, 2);  // the last one
+  vvsfs_delete_entry(dir, 0);  // the first one
+  KUNIT_EXPECT_EQ(test, vvsfs_num_entries(dir), 1);
+  KUNIT_EXPECT_EQ(test, vvsfs_find_entry(dir, "c", 1), 0);
+}
+
+static void
+vvsfs_test_count_names(struct kunit *test) {
+  struct vvsfs_test_image *img = test->priv;
+
+  // /a and /d/b are the same file, /d/c has one name
+  vvsfs_test_mknod(test, 0, "a", 1, 0);
+  vvsfs_test_mknod(test, 0, "d", 2, 1);
+  KUNIT_ASSERT_EQ(test, vvsfs_add_entry(&img->blocks[2], "b", 1, 1), 0);
+  vvsfs_test_mknod(test, 2, "c", 3, 0);
+
+  KUNIT_EXPECT_EQ(test, vvsfs_count_names(vvsfs_test_read, img, 0, 1, 0, "a", 1), 1);
+  KUNIT_EXPECT_EQ(test, vvsfs_count_names(vvsfs_test_read, img, 0, 1, 2, "b", 1), 1);
+  KUNIT_EXPECT_EQ(test, vvsfs_count_names(vvsfs_test_read, img, 0, 3, 2, "c", 1), 0);
+  // the same name in another directory is another link
+  KUNIT_ASSERT_EQ(test, vvsfs_add_entry(&img->blocks[2], "a", 1, 1), 0);
+  KUNIT_EXPECT_EQ(test, vvsfs_count_names(vvsfs_test_read, img, 0, 1, 0, "a", 1), 2);
+  // a directory that can not be read is left out
+  set_bit(2, img->damaged);
+  KUNIT_EXPECT_EQ(test, vvsfs_count_names(vvsfs_test_read, img, 0, 1, 0, "a", 1), 0);
+}
+
+static void
+vvsfs_test_count_names_prefix(struct kunit *test) {
+  struct vvsfs_test_image *img = test->priv;
+
+  // /abc and /ab are the same file, only the whole name is left out
+  vvsfs_test_mknod(test, 0, "abc", 1, 0);
+  KUNIT_ASSERT_EQ(test, vvsfs_add_entry(&img->blocks[0], "ab", 2, 1), 0);
+  KUNIT_EXPECT_EQ(test, vvsfs_count_names(vvsfs_test_read, img, 0, 1, 0, "ab", 2), 1);
+  KUNIT_EXPECT_EQ(test, vvsfs_count_names(vvsfs_test_read, img, 0, 1, 0, "abc", 3), 1);
+  KUNIT_EXPECT_EQ(test, vvsfs_count_names(vvsfs_test_read, img, 0, 1, 0, "a", 1), 2);
+}
+
+static void
+vvsfs_test_resize_data(struct kunit *test) {
+  struct vvsfs_test_image *img = test->priv;
+  struct vvsfs_inode *file = &img->blocks[1];
+
+  file->is_empty = 0;
+  memcpy(file->data, "hello", 5);
+  file->size = 5;
+
+  KUNIT_EXPECT_EQ(test, vvsfs_resize_data(file, 3), 0);
+  KUNIT_EXPECT_EQ(test, file->size, (__u64) 3);
+  KUNIT_EXPECT_EQ(test, file->data[3], (char) 0);
+  KUNIT_EXPECT_EQ(test, file->data[4], (char) 0);
+  KUNIT_EXPECT_EQ(test, vvsfs_resize_data(file, 10), 0);
+  KUNIT_EXPECT_EQ(test, file->size, (__u64) 10);
+  KUNIT_EXPECT_EQ(test, memcmp(file->data, "hel\0\0\0\0\0\0\0", 10), 0);
+  KUNIT_EXPECT_EQ(test, vvsfs_resize_data(file, MAXFILESIZE), 0);
+
+  // bigger than the block only fits compressed
+  KUNIT_EXPECT_EQ(test, vvsfs_resize_data(file, MAXFILESIZE + 1), -ENOSPC);
+  KUNIT_EXPECT_EQ(test, file->size, (__u64) MAXFILESIZE);
+
+  // inline extended attributes leave less room
+  KUNIT_EXPECT_EQ(test, vvsfs_resize_data(file, 0), 0);
+  file->flags |= VVSFS_FL_XATTR;
+  vvsfs_xattr_tail(file)->len = MAXFILESIZE - sizeof(struct vvsfs_xattr_tail) - 100;
+  KUNIT_EXPECT_EQ(test, vvsfs_data_room(file), 100);
+  KUNIT_EXPECT_EQ(test, vvsfs_resize_data(file, 100), 0);
+  KUNIT_EXPECT_EQ(test, vvsfs_resize_data(file, 101), -ENOSPC);
+  KUNIT_EXPECT_EQ(test, vvsfs_xattr_tail(file)->len,
+                  (__u16) (MAXFILESIZE - sizeof(struct vvsfs_xattr_tail) - 100));
+}
+
+static void
+vvsfs_test_check_block(struct kunit *test) {
+  struct vvsfs_test_image *img = test->priv;
+  struct vvsfs_inode *file = &img->blocks[1];
+  struct vvsfs_xattr_entry *e;
+
+  KUNIT_EXPECT_EQ(test, vvsfs_check_block(file), 0);  // empty
+  file->is_empty = 0;
+  file->size = MAXFILESIZE;
+  KUNIT_EXPECT_EQ(test, vvsfs_check_block(file), 0);
+  file->size = MAXFILESIZE + 1;
+  KUNIT_EXPECT_EQ(test, vvsfs_check_block(file), -EIO);
+  file->size = 4000;  // would be copied out of a 512 byte block
+  KUNIT_EXPECT_EQ(test, vvsfs_check_block(file), -EIO);
+
+  // compressed, the logical size may be bigger than the block
+  file->flags |= VVSFS_FL_COMPRESSED;
+  file->csize = MAXFILESIZE;
+  KUNIT_EXPECT_EQ(test, vvsfs_check_block(file), 0);
+  file->csize = MAXFILESIZE + 1;
+  KUNIT_EXPECT_EQ(test, vvsfs_check_block(file), -EIO);
+  file->csize = 10;
+  file->size = MAXCOMPRESSEDSIZE + 1;
+  KUNIT_EXPECT_EQ(test, vvsfs_check_block(file), -EIO);
+
+  // the inline extended attributes take their room
+  file->flags = VVSFS_FL_XATTR;
+  file->size = 100;
+  vvsfs_xattr_tail(file)->len = MAXFILESIZE - sizeof(struct vvsfs_xattr_tail) - 100;
+  KUNIT_EXPECT_EQ(test, vvsfs_check_block(file), 0);
+  file->size = 101;
+  KUNIT_EXPECT_EQ(test, vvsfs_check_block(file), -EIO);
+
+  // a damaged tail or entry is caught before the room is worked out from it
+  file->size = 0;
+  vvsfs_xattr_tail(file)->len = MAXFILESIZE;
+  KUNIT_EXPECT_EQ(test, vvsfs_check_block(file), -EIO);
+  vvsfs_xattr_tail(file)->len = 8;
+  vvsfs_xattr_tail(file)->block = NUMBLOCKS;
+  KUNIT_EXPECT_EQ(test, vvsfs_check_block(file), -EIO);
+  vvsfs_xattr_tail(file)->block = 0;
+  e = (struct vvsfs_xattr_entry *) ((char *) vvsfs_xattr_tail(file) - 8);
+  e->name_len = 2;
+  e->value_len = 2;
+  KUNIT_EXPECT_EQ(test, vvsfs_check_block(file), 0);
+  e->value_len = 200;  // runs past the tail
+  KUNIT_EXPECT_EQ(test, vvsfs_check_block(file), -EIO);
+
+  // a directory holds at most a block of entries
+  img->blocks[0].size = MAXFILESIZE + sizeof(struct vvsfs_dir_entry);
+  KUNIT_EXPECT_EQ(test, vvsfs_check_block(&img->blocks[0]), -EIO);
+}
+
+// vvsfs_bench_alloc - allocation with the table empty, half full and with
+//                     only the last block free, the allocator reads the table
+//                     from the start every time
+static void
+vvsfs_bench_alloc(struct kunit *test) {
+  struct vvsfs_test_image *img = test->priv;
+  int used[] = { 1, NUMBLOCKS / 2, NUMBLOCKS - 1 };
+  u64 start, ns;
+  int i, k, n;
+
+  for (i = 0; i < ARRAY_SIZE(used); i++) {
+    for (k = 1; k < NUMBLOCKS; k++)
+      img->blocks[k].is_empty = k >= used[i];
+    img->reads = 0;
+    start = ktime_get_ns();
+    for (n = 0; n < VVSFS_BENCH_LOOPS; n++)
+      KUNIT_ASSERT_EQ(test, vvsfs_find_empty(vvsfs_test_read, img), used[i]);
+    ns = ktime_get_ns() - start;
+    kunit_info(test, "alloc with %d of %d blocks used : %llu ns, %lu block reads each\n",
+               used[i], NUMBLOCKS, div_u64(ns, VVSFS_BENCH_LOOPS),
+               img->reads / VVSFS_BENCH_LOOPS);
+  }
+}
+
+// vvsfs_bench_lookup - every name of a full directory in turn, and a miss
+static void
+vvsfs_bench_lookup(struct kunit *test) {
+  struct vvsfs_test_image *img = test->priv;
+  struct vvsfs_inode *dir = &img->blocks[0];
+  char names[VVSFS_MAX_ENTRIES][MAXNAME + 1];
+  u64 start, ns;
+  int k, n;
+
+  for (k = 0; k < VVSFS_MAX_ENTRIES; k++) {
+    snprintf(names[k], MAXNAME + 1, "file%03d", k);
+    KUNIT_ASSERT_EQ(test, vvsfs_add_entry(dir, names[k], strlen(names[k]), k + 1), 0);
+  }
+
+  start = ktime_get_ns();
+  for (n = 0; n < VVSFS_BENCH_LOOPS; n++) {
+    k = n % VVSFS_MAX_ENTRIES;
+    KUNIT_ASSERT_EQ(test, vvsfs_find_entry(dir, names[k], strlen(names[k])), k);
+  }
+  ns = ktime_get_ns() - start;
+  kunit_info(test, "lookup in %d entries : %llu ns\n", VVSFS_MAX_ENTRIES,
+             div_u64(ns, VVSFS_BENCH_LOOPS));
+
+  start = ktime_get_ns();
+  for (n = 0; n < VVSFS_BENCH_LOOPS; n++)
+    KUNIT_ASSERT_EQ(test, vvsfs_find_entry(dir, "missing", 7), -1);
+  ns = ktime_get_ns() - start;
+  kunit_info(test, "failed lookup in %d entries : %llu ns\n", VVSFS_MAX_ENTRIES,
+             div_u64(ns, VVSFS_BENCH_LOOPS));
+}
+
+// vvsfs_bench_insert - fill a directory, emptied again after every round
+static void
+vvsfs_bench_insert(struct kunit *test) {
+  struct vvsfs_test_image *img = test->priv;
+  struct vvsfs_inode *dir = &img->blocks[0];
+  u64 start, ns;
+  int k, n;
+
+  start = ktime_get_ns();
+  for (n = 0; n < VVSFS_BENCH_LOOPS; n++) {
+    dir->size = 0;
+    for (k = 0; k < VVSFS_MAX_ENTRIES; k++)
+      KUNIT_ASSERT_EQ(test, vvsfs_add_entry(dir, "file", 4, k + 1), 0);
+  }
+  ns = ktime_get_ns() - start;
+  kunit_info(test, "insert into %d entries : %llu ns\n", VVSFS_MAX_ENTRIES,
+             div_u64(ns, (u64) VVSFS_BENCH_LOOPS * VVSFS_MAX_ENTRIES));
+}
+
+static struct kunit_case vvsfs_test_cases[] = {
+  KUNIT_CASE(vvsfs_test_find_empty),
+  KUNIT_CASE(vvsfs_test_add_entry),
+  KUNIT_CASE(vvsfs_test_add_entry_name),
+  KUNIT_CASE(vvsfs_test_find_entry),
+  KUNIT_CASE(vvsfs_test_delete_entry),
+  KUNIT_CASE(vvsfs_test_count_names),
+  KUNIT_CASE(vvsfs_test_count_names_prefix),
+  KUNIT_CASE(vvsfs_test_resize_data),
+  KUNIT_CASE(vvsfs_test_check_block),
+  KUNIT_CASE(vvsfs_bench_alloc),
+  KUNIT_CASE(vvsfs_bench_lookup),
+  KUNIT_CASE(vvsfs_bench_insert),
+  {}
+};
+
+static struct kunit_suite vvsfs_test_suite = {
+  .name = "vvsfs",
+  .init = vvsfs_test_init,
+  .test_cases = vvsfs_test_cases,
+};
+
+kunit_test_suite(vvsfs_test_suite);
+
+MODULE_LICENSE("GPL");